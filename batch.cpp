@@ -0,0 +1,349 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hlfix.h"
+#include "main.h"
+#include "batch.h"
+
+using namespace std;
+
+// memory a map is assumed to take while it is converted, for each byte of its RMF, the RMF itself included
+#define BATCH_MEMORY_FACTOR 4
+
+class BatchJob
+{
+  public:
+  string input, output;
+  vector<char> rmf;
+  double memory; // reserved from when it is read until it is converted
+  int done;
+  HLFixError error;
+  HLFixStats stats;
+  double readTime, loadTime, processTime, writeTime;
+
+  BatchJob() : memory(0), done(0), readTime(0), loadTime(0), processTime(0), writeTime(0)
+  {
+    memset(&error,0,sizeof(error));
+    memset(&stats,0,sizeof(stats));
+  }
+};
+
+class Batch
+{
+  public:
+  vector<BatchJob> jobs;
+  HLFixOptions options;
+  const vector<string> *wads;
+  double memory, reserved;
+  deque<int> ready; // maps read and waiting to be converted
+  int nmaps, nread, nprinted, nfailed;
+  mutex lock;
+  condition_variable wake;
+};
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void SetBatchError(BatchJob &job, int code, const char *msg, const string &fn)
+{
+  job.error.code = code;
+  snprintf(job.error.msg,sizeof(job.error.msg),"%s %s",msg,fn.c_str());
+}
+
+// splits a line of the list into the input and output, returning 0 if it has neither
+static int ParseBatchLine(char *line, const char *ext, BatchJob *job)
+{
+  char *p, *end;
+  size_t dot;
+
+  line[strcspn(line,"\r\n")] = '\0';
+
+  for (p = line; *p == ' ' || *p == '\t'; p++);
+
+  if (*p == '\0' || *p == '#')
+    return 0;
+
+  if ((end = strchr(p,'\t')) == NULL && (end = strchr(p,' ')) == NULL)
+    end = p + strlen(p);
+
+  job->input.assign(p,end);
+
+  for (p = end; *p == ' ' || *p == '\t'; p++);
+
+  for (end = p + strlen(p); end != p && (end[-1] == ' ' || end[-1] == '\t'); end--);
+
+  job->output.assign(p,end);
+
+  if (job->input.find('.') == string::npos)
+    job->input += ".rmf";
+
+  if (job->output.empty())
+  {
+    // as ParseFileName() does, but a line may be longer than its buffer
+
+    job->output = job->input;
+
+    if ((dot = job->output.find_last_of(".\\")) != string::npos && job->output[dot] == '.')
+      job->output.erase(dot);
+
+    job->output += ext;
+  }
+
+  return 1;
+}
+
+static int ReadBatchList(const char *listfn, const char *ext, vector<BatchJob> *jobs)
+{
+  char line[2*FILENAME_MAX+4];
+  BatchJob job;
+  FILE *f;
+
+  if ((f = fopen(listfn,"r")) == NULL)
+    return 0;
+
+  while (fgets(line,sizeof(line),f) != NULL)
+    if (ParseBatchLine(line,ext,&job))
+      jobs->push_back(job);
+
+  fclose(f);
+  return 1;
+}
+
+static void PrintBatchJob(Batch *batch, int i)
+{
+  BatchJob &job = batch->jobs[i];
+  HLFixError &e = job.error;
+
+  printf("  [%i/%i] %s -> %s: ",i+1,int(batch->jobs.size()),job.input.c_str(),job.output.c_str());
+
+  if (e.code == HLFIX_OK)
+    printf("done");
+  else if (e.code == HLFIX_ERROR_GEOMETRY)
+    printf("ERROR (Entity %i, Brush %i): %s",e.entity,e.brush,e.msg);
+  else if (e.code == HLFIX_ERROR_READ)
+    printf("ERROR at offset %08xh (Entity %i, Brush %i): %s",e.offset,e.entity,e.brush,e.msg);
+  else
+    printf("ERROR: %s",e.msg);
+
+  printf(", %i solids read, %i written, read %.3lfs, load %.3lfs, process %.3lfs, write %.3lfs\n",
+    job.stats.nsolidsRead,job.stats.nsolidsProcessed,job.readTime,job.loadTime,job.processTime,job.writeTime);
+  fflush(stdout);
+}
+
+// called with the lock held once a map is converted or has failed, printing the summaries now in order
+static void FinishBatchJob(Batch *batch, int i)
+{
+  BatchJob &job = batch->jobs[i];
+
+  job.done = 1;
+  batch->reserved -= job.memory;
+
+  if (job.error.code != HLFIX_OK)
+    batch->nfailed++;
+
+  while (batch->nprinted < int(batch->jobs.size()) && batch->jobs[batch->nprinted].done)
+    PrintBatchJob(batch,batch->nprinted++);
+
+  batch->wake.notify_all();
+}
+
+static void ConvertBatchJob(Batch *batch, BatchJob &job)
+{
+  chrono::steady_clock::time_point start;
+  HLFixError error;
+  HLFixMap *map;
+  FILE *f;
+  int i;
+
+  start = chrono::steady_clock::now();
+  map = HLFixLoad(job.rmf.empty() ? NULL : &job.rmf[0],job.rmf.size(),&batch->options,&job.error);
+  vector<char>().swap(job.rmf);
+  job.loadTime = Seconds(start);
+
+  if (map == NULL)
+    return;
+
+  for (i = 0; i < int(batch->wads->size()); i++)
+    HLFixAddWad(map,(*batch->wads)[i].c_str());
+
+  start = chrono::steady_clock::now();
+  HLFixProcess(map,&job.error);
+  job.processTime = Seconds(start);
+
+  // as for a single map, the output is written even if a pass failed
+
+  start = chrono::steady_clock::now();
+
+  if ((f = fopen(job.output.c_str(),batch->options.writeRMF ? "wb" : "w")) == NULL)
+  {
+    if (job.error.code == HLFIX_OK)
+      SetBatchError(job,HLFIX_ERROR_WRITE,"can't open",job.output);
+  }
+  else
+  {
+    if (HLFixWrite(map,WriteFile,f,&error) != HLFIX_OK && job.error.code == HLFIX_OK)
+      job.error = error;
+
+    if (fclose(f) != 0 && job.error.code == HLFIX_OK)
+      SetBatchError(job,HLFIX_ERROR_WRITE,"can't write",job.output);
+  }
+
+  job.writeTime = Seconds(start);
+
+  HLFixGetStats(map,&job.stats);
+  HLFixFree(map);
+}
+
+static void BatchWorker(Batch *batch)
+{
+  unique_lock<mutex> guard(batch->lock);
+  int i;
+
+  for (;;)
+  {
+    while (batch->ready.empty() && batch->nread < int(batch->jobs.size()))
+      batch->wake.wait(guard);
+
+    if (batch->ready.empty())
+      break;
+
+    i = batch->ready.front();
+    batch->ready.pop_front();
+    batch->wake.notify_all();
+
+    guard.unlock();
+    ConvertBatchJob(batch,batch->jobs[i]);
+    guard.lock();
+
+    FinishBatchJob(batch,i);
+  }
+}
+
+/*
+Reads the inputs in order. A map is only read once there is room for it in memory and fewer than nmaps are
+waiting, except that one is always let through when nothing else is held so that a map too large still gets
+converted
+*/
+
+static void ReadBatchInputs(Batch *batch)
+{
+  chrono::steady_clock::time_point start;
+  long size;
+  int i, ok;
+  FILE *f;
+
+  for (i = 0; i < int(batch->jobs.size()); i++)
+  {
+    BatchJob &job = batch->jobs[i];
+
+    if ((f = fopen(job.input.c_str(),"rb")) == NULL)
+    {
+      SetBatchError(job,HLFIX_ERROR_ARGUMENT,"can't open",job.input);
+
+      lock_guard<mutex> guard(batch->lock);
+      batch->nread++;
+      FinishBatchJob(batch,i);
+      continue;
+    }
+
+    fseek(f,0,SEEK_END);
+    size = ftell(f);
+    fseek(f,0,SEEK_SET);
+
+    job.memory = double(size > 0 ? size : 0) * BATCH_MEMORY_FACTOR;
+
+    {
+      unique_lock<mutex> guard(batch->lock);
+
+      while (batch->reserved > 0 && (batch->reserved + job.memory > batch->memory || int(batch->ready.size()) >= batch->nmaps))
+        batch->wake.wait(guard);
+
+      batch->reserved += job.memory;
+    }
+
+    start = chrono::steady_clock::now();
+    ok = ReadFile(f,&job.rmf);
+    fclose(f);
+    job.readTime = Seconds(start);
+
+    lock_guard<mutex> guard(batch->lock);
+
+    batch->nread++;
+
+    if (ok)
+      batch->ready.push_back(i);
+    else
+    {
+      SetBatchError(job,HLFIX_ERROR_ARGUMENT,"can't read",job.input);
+      vector<char>().swap(job.rmf);
+      FinishBatchJob(batch,i);
+    }
+
+    batch->wake.notify_all();
+  }
+}
+
+int RunBatch(const char *listfn, const HLFixOptions *options, const vector<string> &wads, int nmaps, double memory)
+{
+  chrono::steady_clock::time_point start;
+  vector<thread> threads;
+  Batch batch;
+  int i;
+
+  start = chrono::steady_clock::now();
+
+  printf("Reading map list file %s... ",listfn);
+  fflush(stdout);
+
+  if (!ReadBatchList(listfn,options->writeRMF ? ".rmf" : ".map",&batch.jobs))
+  {
+    printf("can't open %s\n",listfn);
+    return 1;
+  }
+
+  printf("done\n");
+
+  // maps are converted in parallel instead of their solids, and their messages are left out of the summaries
+
+  batch.options = *options;
+  batch.options.threads = 0;
+  batch.options.message = NULL;
+  batch.wads = &wads;
+  batch.memory = memory;
+  batch.reserved = 0;
+  batch.nmaps = nmaps < int(batch.jobs.size()) ? nmaps : int(batch.jobs.size());
+  batch.nread = batch.nprinted = batch.nfailed = 0;
+
+  printf("Converting %i maps, %i at a time\n",int(batch.jobs.size()),batch.nmaps);
+  fflush(stdout);
+
+  for (i = 0; i < batch.nmaps; i++)
+    threads.push_back(thread(BatchWorker,&batch));
+
+  ReadBatchInputs(&batch);
+
+  for (i = 0; i < int(threads.size()); i++)
+    threads[i].join();
+
+  printf("%i of %i maps converted without errors in %.3lfs\n",int(batch.jobs.size()) - batch.nfailed,int(batch.jobs.size()),Seconds(start));
+
+  return batch.nfailed > 0;
+}
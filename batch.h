@@ -0,0 +1,31 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_BATCH
+#define _INC_BATCH
+
+#include <string>
+#include <vector>
+#include "hlfix.h"
+
+using namespace std;
+
+/*
+Converts the maps listed in listfn, nmaps at a time, with the given options and wads. Each line of the list is an
+input file, optionally followed by the output file after a tab, or after a space if neither name contains one.
+Blank lines and lines starting with # are skipped. Inputs are read ahead in order while earlier maps are being
+converted, as long as the maps read and not yet converted are estimated to fit in memory bytes. A summary of
+each map is printed in the order of the list. Returns 0 if every map was converted without errors
+*/
+
+int RunBatch(const char *listfn, const HLFixOptions *options, const vector<string> &wads, int nmaps, double memory);
+
+#endif
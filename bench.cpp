@@ -0,0 +1,396 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include <list>
+#include <set>
+#include <vector>
+#include "geo.h"
+#include "kernel.h"
+#include "cd.h"
+#include "bsp.h"
+#include "bench.h"
+
+using namespace std;
+
+#define BENCH_MIN_TIME (CLOCKS_PER_SEC / 4)
+
+class BenchSolid
+{
+  public:
+  GeoSolid *solid;
+  GeoPointArray points;
+  vector<GeoVector> verts;
+  vector<GeoPlane> planes;
+};
+
+class BenchVertexIsLeftOf
+{
+  public:
+  GeoVector n;
+
+  BenchVertexIsLeftOf(GeoVector tn) : n(tn) { }
+
+  bool operator()(const GeoVector &a, const GeoVector &b) const
+  {
+    return a*n < b*n;
+  }
+};
+
+class BenchCutPoint
+{
+  public:
+  double t;
+  GeoVector v;
+
+  bool operator<(const BenchCutPoint &p) const
+  {
+    return t < p.t;
+  }
+};
+
+void GatherBenchSolids(GeoGroup *group, vector<BenchSolid> *solids)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  list<GeoSolid>::iterator isolid;
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<list<GeoEdge> >::iterator ile;
+  list<GeoSolid*> all;
+  list<GeoSolid*>::iterator ip;
+
+  foreach (igroup,group->groups)
+    GatherBenchSolids(&*igroup,solids);
+
+  foreach (ientity,group->entities)
+    foreach (isolid,ientity->solids)
+      all.push_back(&*isolid);
+
+  foreach (isolid,group->solids)
+    all.push_back(&*isolid);
+
+  foreach (ip,all)
+  {
+    solids->push_back(BenchSolid());
+    solids->back().solid = *ip;
+
+    foreach (iface,(*ip)->faces)
+    {
+      solids->back().planes.push_back(iface->plane());
+
+      foreach (ie,iface->edges)
+      {
+        solids->back().points.push_back(ie->v1);
+        solids->back().verts.push_back(ie->v1);
+      }
+
+      foreach (ile,iface->inedges)
+        foreach (ie,*ile)
+        {
+          solids->back().points.push_back(ie->v1);
+          solids->back().verts.push_back(ie->v1);
+        }
+    }
+  }
+}
+
+// classifies with GeoVector::sideOf() walking the face edge lists, as CutSolid used to
+int BenchSideOf(vector<BenchSolid> &solids, vector<signed char> *sides)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<list<GeoEdge> >::iterator ile;
+  vector<BenchSolid>::iterator is;
+  vector<GeoPlane>::iterator ip;
+  int n = 0;
+
+  foreach (is,solids)
+    foreach (ip,is->planes)
+      foreach (iface,is->solid->faces)
+      {
+        foreach (ie,iface->edges)
+          (*sides)[n++] = ie->v1.sideOf(*ip);
+
+        foreach (ile,iface->inedges)
+          foreach (ie,*ile)
+            (*sides)[n++] = ie->v1.sideOf(*ip);
+      }
+
+  return n;
+}
+
+int BenchKernel(vector<BenchSolid> &solids, GeoClassifyFunc func, vector<signed char> *sides)
+{
+  vector<BenchSolid>::iterator is;
+  vector<GeoPlane>::iterator ip;
+  int n = 0;
+
+  foreach (is,solids)
+    foreach (ip,is->planes)
+    {
+      if (is->points.size() == 0)
+        continue;
+
+      func(&is->points.x[0],&is->points.y[0],&is->points.z[0],is->points.size(),*ip,GeoCurContext->epsilon,&(*sides)[n]);
+      n += is->points.size();
+    }
+
+  return n;
+}
+
+int BenchMultiset(vector<BenchSolid> &solids, double *check)
+{
+  vector<BenchSolid>::iterator is;
+  vector<GeoPlane>::iterator ip;
+  vector<GeoVector>::iterator iv;
+  int n = 0;
+
+  foreach (is,solids)
+    foreach (ip,is->planes)
+    {
+      multiset<GeoVector,BenchVertexIsLeftOf> verts(BenchVertexIsLeftOf(ip->norm));
+
+      foreach (iv,is->verts)
+        verts.insert(*iv);
+
+      *check += verts.begin()->x;
+      n += verts.size();
+    }
+
+  return n;
+}
+
+int BenchStableSort(vector<BenchSolid> &solids, double *check)
+{
+  vector<BenchSolid>::iterator is;
+  vector<GeoPlane>::iterator ip;
+  vector<GeoVector>::iterator iv;
+  vector<BenchCutPoint> verts;
+  BenchCutPoint p;
+  int n = 0;
+
+  foreach (is,solids)
+    foreach (ip,is->planes)
+    {
+      verts.clear();
+
+      foreach (iv,is->verts)
+      {
+        p.t = *iv * ip->norm;
+        p.v = *iv;
+        verts.push_back(p);
+      }
+
+      stable_sort(verts.begin(),verts.end());
+
+      *check += verts.begin()->v.x;
+      n += verts.size();
+    }
+
+  return n;
+}
+
+class BenchTotals
+{
+  public:
+  int nsolids, nfaces;
+  double volume;
+
+  BenchTotals() : nsolids(0), nfaces(0), volume(0) {}
+};
+
+void SumSolids(GeoGroup *group, BenchTotals *totals)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  list<GeoSolid>::iterator isolid;
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<GeoSolid*> all;
+  list<GeoSolid*>::iterator ip;
+
+  foreach (igroup,group->groups)
+    SumSolids(&*igroup,totals);
+
+  foreach (ientity,group->entities)
+    foreach (isolid,ientity->solids)
+      all.push_back(&*isolid);
+
+  foreach (isolid,group->solids)
+    all.push_back(&*isolid);
+
+  foreach (ip,all)
+  {
+    totals->nsolids++;
+
+    foreach (iface,(*ip)->faces)
+    {
+      totals->nfaces++;
+
+      // divergence theorem over a fan of triangles from the first vertex
+      foreach (ie,iface->edges)
+        totals->volume += (iface->edges.front().v1 * (ie->v1 % ie->v2)) / 6;
+    }
+  }
+}
+
+// returns the time taken in milliseconds
+double BenchDecompose(GeoGroup *group, const char *name, void (*decompose)(GeoGroup *), BenchTotals *totals, double base)
+{
+  GeoGroup copy;
+  clock_t t;
+  double ms;
+
+  copy = *group;
+
+  t = clock();
+
+  try
+  {
+    decompose(&copy);
+  }
+
+  catch (GeoException *ex)
+  {
+    printf("  ERROR (Entity %i, Brush %i): %s\n",ex->entity,ex->brush,ex->msg);
+    delete ex;
+  }
+
+  t = clock() - t;
+  ms = double(t) / CLOCKS_PER_SEC * 1000;
+
+  SumSolids(&copy,totals);
+
+  if (base > 0)
+    printf("  %-24s %8.1lf ms  %6.2lfx  %6i brushes %7i faces  volume %.1lf\n",name,ms,base / ms,totals->nsolids,totals->nfaces,totals->volume);
+  else
+    printf("  %-24s %8.1lf ms           %6i brushes %7i faces  volume %.1lf\n",name,ms,totals->nsolids,totals->nfaces,totals->volume);
+
+  return ms;
+}
+
+void PrintBench(const char *name, clock_t t, int reps, int n, double base)
+{
+  double ns = double(t) / CLOCKS_PER_SEC * 1e9 / reps / n;
+
+  if (base > 0)
+    printf("  %-24s %8.2lf ns/point  %6.2lfx\n",name,ns,base / ns);
+  else
+    printf("  %-24s %8.2lf ns/point\n",name,ns);
+}
+
+void RunBenchmarks(GeoGroup *group)
+{
+  vector<BenchSolid> solids;
+  vector<BenchSolid>::iterator is;
+  vector<GeoClassifyKernel> kernels;
+  vector<GeoClassifyKernel>::iterator ik;
+  vector<signed char> ref, sides;
+  BenchTotals cut, bsp;
+  clock_t t;
+  double base, check1, check2;
+  int n, reps;
+
+  GatherBenchSolids(group,&solids);
+  kernels = GeoClassifyKernels();
+
+  n = 0;
+
+  foreach (is,solids)
+    n += is->points.size() * is->planes.size();
+
+  printf("Benchmarking %i solids, %i point/plane classifications per pass\n",(int)solids.size(),n);
+
+  if (n == 0)
+    return;
+
+  ref.resize(n);
+  sides.resize(n);
+
+  printf("Plane classification\n");
+
+  t = clock();
+  reps = 0;
+
+  do
+  {
+    BenchSideOf(solids,&ref);
+    ++reps;
+  }
+  while (clock() - t < BENCH_MIN_TIME);
+
+  t = clock() - t;
+  base = double(t) / CLOCKS_PER_SEC * 1e9 / reps / n;
+  PrintBench("sideOf (edge lists)",t,reps,n,0);
+
+  foreach (ik,kernels)
+  {
+    t = clock();
+    reps = 0;
+
+    do
+    {
+      BenchKernel(solids,ik->func,&sides);
+      ++reps;
+    }
+    while (clock() - t < BENCH_MIN_TIME);
+
+    t = clock() - t;
+    PrintBench(ik->name,t,reps,n,base);
+
+    if (sides != ref)
+      printf("  ERROR: %s kernel disagrees with sideOf\n",ik->name);
+  }
+
+  printf("Cut point sorting\n");
+
+  check1 = check2 = 0;
+  t = clock();
+  reps = 0;
+
+  do
+  {
+    n = BenchMultiset(solids,&check1);
+    ++reps;
+  }
+  while (clock() - t < BENCH_MIN_TIME);
+
+  t = clock() - t;
+  base = double(t) / CLOCKS_PER_SEC * 1e9 / reps / n;
+  PrintBench("multiset",t,reps,n,0);
+  check1 /= reps;
+
+  t = clock();
+  reps = 0;
+
+  do
+  {
+    n = BenchStableSort(solids,&check2);
+    ++reps;
+  }
+  while (clock() - t < BENCH_MIN_TIME);
+
+  t = clock() - t;
+  PrintBench("stable_sort",t,reps,n,base);
+  check2 /= reps;
+
+  if (check1 != check2)
+    printf("  ERROR: stable_sort order disagrees with multiset\n");
+
+  printf("Decomposition\n");
+
+  GeoCurContext->flagQuiet = 1;
+  base = BenchDecompose(group,"DecomposeGroup",DecomposeGroup,&cut,0);
+  BenchDecompose(group,"DecomposeGroupBSP",DecomposeGroupBSP,&bsp,base);
+  GeoCurContext->flagQuiet = 0;
+}
@@ -0,0 +1,483 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <list>
+#include <vector>
+#include "geo.h"
+#include "cd.h"
+#include "bsp.h"
+#include "pool.h"
+
+using namespace std;
+
+/*
+The solid's faces are clipped down the tree as fragments. Only their vertices are kept, since they are only ever
+tested against planes. At each node:
+- if no fragment has a vertex in front of another fragment's plane, the part of the solid in the cell is convex
+  and is the intersection of the cell with the space behind every fragment
+- otherwise the cell is split by the plane of the violating fragment with the most reflex edges. The fragments
+  lying in that plane are used up, and a side left with no fragments is wholly outside the solid if it is in
+  front of the plane, or wholly inside if it is behind it
+Each leaf is kept as the list of planes bounding it, and turned into faces by clipping a large polygon on each
+plane against all the others. A solid with holes in its faces, whose inner cycles the fragments leave out, or with a
+leaf that comes out without volume is cut by DecomposeSolid() instead, so that no part of it goes missing.
+*/
+
+class BSPFragment
+{
+  public:
+  vector<GeoVector> verts;
+  GeoPlane plane;
+  int reflex;
+};
+
+// signed distance of v in front of p
+static inline double PlaneDist(const GeoVector &v, const GeoPlane &p)
+{
+  return v * p.norm + p.d;
+}
+
+// splits a polygon by a plane, vertices within the plane going to both sides
+void SplitPolygon(const vector<GeoVector> &verts, const GeoPlane &plane, vector<GeoVector> *front, vector<GeoVector> *back)
+{
+  vector<int> sides(verts.size());
+  GeoVector a, b, v;
+  double da, db;
+  int i, j, n = verts.size();
+
+  for (i = 0; i < n; i++)
+    sides[i] = verts[i].sideOf(plane);
+
+  for (i = 0; i < n; i++)
+  {
+    j = (i + 1) % n;
+    a = verts[i];
+    b = verts[j];
+
+    if (sides[i] >= 0 && front != NULL)
+      front->push_back(a);
+
+    if (sides[i] <= 0 && back != NULL)
+      back->push_back(a);
+
+    if (sides[i] * sides[j] < 0)
+    {
+      da = PlaneDist(a,plane);
+      db = PlaneDist(b,plane);
+      v = a + (b - a) * (da / (da - db));
+
+      if (front != NULL)
+        front->push_back(v);
+
+      if (back != NULL)
+        back->push_back(v);
+    }
+  }
+}
+
+// returns twice the area of a planar polygon
+static double PolygonArea(const vector<GeoVector> &verts)
+{
+  GeoVector area(0,0,0);
+  int i, n = verts.size();
+
+  for (i = 0; i < n; i++)
+    area = area + verts[i] % verts[(i + 1) % n];
+
+  return sqrt(area * area);
+}
+
+// returns 1 if the two planes face the same way and are equal within epsilon
+static int SamePlane(const GeoPlane &a, const GeoPlane &b)
+{
+  return a.norm == b.norm && fequal(a.d,b.d);
+}
+
+// returns 1 if any of the vertices lies on the given side of the plane
+static int HasSide(const vector<GeoVector> &verts, const GeoPlane &plane, int side)
+{
+  int i;
+
+  for (i = 0; i < int(verts.size()); i++)
+    if (verts[i].sideOf(plane) == side)
+      return 1;
+
+  return 0;
+}
+
+// returns 1 if any vertex of any fragment lies in front of the plane
+static int HasFront(const vector<BSPFragment> &fragments, const GeoPlane &plane)
+{
+  int i;
+
+  for (i = 0; i < int(fragments.size()); i++)
+    if (HasSide(fragments[i].verts,plane,SIDE_FRONT))
+      return 1;
+
+  return 0;
+}
+
+static void AddPlane(vector<GeoPlane> *planes, const GeoPlane &plane)
+{
+  int i;
+
+  for (i = 0; i < int(planes->size()); i++)
+    if (SamePlane((*planes)[i],plane))
+      return;
+
+  planes->push_back(plane);
+}
+
+void PartitionFragments(const vector<GeoPlane> &cell, const vector<BSPFragment> &fragments, list<vector<GeoPlane> > *leaves)
+{
+  vector<BSPFragment> front, back;
+  vector<GeoPlane> planes;
+  BSPFragment piece;
+  GeoPlane splitter;
+  int i, best;
+
+  // find the violating fragment with the most reflex edges
+
+  best = -1;
+
+  for (i = 0; i < int(fragments.size()); i++)
+    if ((best < 0 || fragments[i].reflex > fragments[best].reflex) && HasFront(fragments,fragments[i].plane))
+      best = i;
+
+  if (best < 0)
+  {
+    planes = cell;
+
+    for (i = 0; i < int(fragments.size()); i++)
+      AddPlane(&planes,fragments[i].plane);
+
+    GeoDebugPrintf("    Convex leaf with %i planes\n",int(planes.size()));
+
+    leaves->push_back(planes);
+    return;
+  }
+
+  splitter = fragments[best].plane;
+
+  GeoDebugPrintf("    Splitting %i fragments by plane [%lg %lg %lg %lg] with %i reflex edges\n",
+    int(fragments.size()),splitter.norm.x,splitter.norm.y,splitter.norm.z,splitter.d,fragments[best].reflex);
+
+  for (i = 0; i < int(fragments.size()); i++)
+  {
+    // fragments lying in the splitting plane are used up
+
+    piece = fragments[i];
+
+    // clipping a non-convex fragment can leave zero area slivers along the splitting plane, which are dropped
+
+    if (HasSide(fragments[i].verts,splitter,SIDE_FRONT))
+    {
+      piece.verts.clear();
+      SplitPolygon(fragments[i].verts,splitter,&piece.verts,NULL);
+
+      if (PolygonArea(piece.verts) >= GeoCurContext->epsilon)
+        front.push_back(piece);
+    }
+
+    if (HasSide(fragments[i].verts,splitter,SIDE_BACK))
+    {
+      piece.verts.clear();
+      SplitPolygon(fragments[i].verts,splitter,NULL,&piece.verts);
+
+      if (PolygonArea(piece.verts) >= GeoCurContext->epsilon)
+        back.push_back(piece);
+    }
+  }
+
+  planes = cell;
+  splitter.reverse();
+  planes.push_back(splitter);
+
+  if (!front.empty())
+    PartitionFragments(planes,front,leaves);
+
+  planes.back().reverse();
+
+  if (back.empty())
+  {
+    GeoDebugPrintf("    Solid leaf behind plane\n");
+    leaves->push_back(planes);
+  }
+  else
+    PartitionFragments(planes,back,leaves);
+}
+
+/*
+Returns the texture of the face of the solid lying in plane and facing the same way that contains the centre of the
+leaf face, which is convex. Faces in the same plane can have different textures, so the first of them is only used
+when none contains it, and NULL when there are none
+*/
+
+static GeoTexture LeafTexture(GeoSolid &solid, const GeoPlane &plane, const GeoFace &face)
+{
+  list<GeoFace>::iterator iface, ifaceFirst;
+  list<GeoEdge>::const_iterator ie;
+  GeoVector center(0,0,0);
+  GeoTexture tex;
+
+  foreach (ie, face.edges)
+    center = center + ie->v1;
+
+  center = center * (1.0 / face.edges.size());
+  ifaceFirst = solid.faces.end();
+
+  foreach (iface, solid.faces)
+    if (SamePlane(iface->plane(),plane))
+    {
+      if (center.isIn(*iface))
+        return iface->tex;
+
+      if (ifaceFirst == solid.faces.end())
+        ifaceFirst = iface;
+    }
+
+  if (ifaceFirst != solid.faces.end())
+    return ifaceFirst->tex;
+
+  strcpy(tex.texture,"NULL");
+  tex.ushift = tex.vshift = tex.rot = 0;
+  tex.uscale = tex.vscale = 1;
+  tex.uaxis = face.edges.front().vec() % plane.norm;
+  tex.vaxis = tex.uaxis % plane.norm;
+  tex.uaxis.normalize();
+  tex.vaxis.normalize();
+
+  return tex;
+}
+
+/*
+Builds a convex solid from the planes bounding it, giving each face the texture of the original face in the same
+plane. Returns 0 if the planes don't bound a solid with volume
+*/
+
+int BuildLeafSolid(GeoSolid &solid, const vector<GeoPlane> &planes, const GeoVector &center, double radius, GeoSolid *leaf)
+{
+  vector<GeoVector> poly, clipped;
+  GeoVector u, v, c, n;
+  GeoFace face;
+  GeoEdge edge;
+  int i, j, k;
+
+  leaf->faces.clear();
+
+  for (i = 0; i < int(planes.size()); i++)
+  {
+    // a square much larger than the solid, lying in the plane and wound counterclockwise around its normal
+
+    n = planes[i].norm;
+    u = fabs(n.x) < 0.6 ? GeoVector(1,0,0) % n : GeoVector(0,1,0) % n;
+    u.normalize();
+    v = n % u;
+    c = center - n * PlaneDist(center,planes[i]);
+
+    poly.clear();
+    poly.push_back(c - u * radius - v * radius);
+    poly.push_back(c + u * radius - v * radius);
+    poly.push_back(c + u * radius + v * radius);
+    poly.push_back(c - u * radius + v * radius);
+
+    for (j = 0; j < int(planes.size()) && poly.size() >= 3; j++)
+    {
+      if (j == i)
+        continue;
+
+      clipped.clear();
+      SplitPolygon(poly,planes[j],NULL,&clipped);
+      poly.swap(clipped);
+    }
+
+    // drop repeated vertices left by clipping through a vertex
+
+    clipped.clear();
+
+    for (j = 0; j < int(poly.size()); j++)
+      if (poly[j] != poly[(j + 1) % poly.size()])
+        clipped.push_back(poly[j]);
+
+    if (clipped.size() < 3 || PolygonArea(clipped) < GeoCurContext->epsilon)
+      continue;
+
+    face = GeoFace();
+    face.index = leaf->faces.size();
+
+    for (k = 0; k < int(clipped.size()); k++)
+    {
+      edge.v1 = clipped[k];
+      edge.v2 = clipped[(k + 1) % clipped.size()];
+      edge.index = k;
+      face.edges.push_back(edge);
+    }
+
+    face.tex = LeafTexture(solid,planes[i],face);
+    leaf->faces.push_back(face);
+  }
+
+  SnapVertices(leaf);
+
+  leaf->color = solid.color;
+  leaf->visgroup = solid.visgroup;
+  leaf->index = solid.index;
+
+  return leaf->faces.size() >= 4;
+}
+
+void DecomposeSolidBSP(GeoSolid &solid, list<GeoSolid> *solids)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<vector<GeoPlane> > leaves;
+  list<vector<GeoPlane> >::iterator il;
+  list<GeoSolid> built;
+  vector<BSPFragment> fragments;
+  vector<GeoPlane> cell;
+  BSPFragment fragment;
+  GeoVector lo(DBL_MAX,DBL_MAX,DBL_MAX), hi(-DBL_MAX,-DBL_MAX,-DBL_MAX);
+  GeoSolid leaf;
+
+  foreach (iface, solid.faces)
+    if (!iface->inedges.empty())
+    {
+      GeoPrintMessage("Cutting non-convex solid instead of using a BSP tree, as it has faces with holes");
+      DecomposeSolid(solid,solids);
+      return;
+    }
+
+  foreach (iface, solid.faces)
+  {
+    fragment.verts.clear();
+    fragment.plane = iface->plane();
+    fragment.reflex = iface->reflex;
+
+    foreach (ie, iface->edges)
+    {
+      fragment.verts.push_back(ie->v1);
+
+      lo.x = min(lo.x,ie->v1.x);
+      lo.y = min(lo.y,ie->v1.y);
+      lo.z = min(lo.z,ie->v1.z);
+      hi.x = max(hi.x,ie->v1.x);
+      hi.y = max(hi.y,ie->v1.y);
+      hi.z = max(hi.z,ie->v1.z);
+    }
+
+    fragments.push_back(fragment);
+  }
+
+  // the starting cell is the bounding box of the solid
+
+  cell.push_back(GeoPlane(GeoVector(1,0,0),-hi.x));
+  cell.push_back(GeoPlane(GeoVector(-1,0,0),lo.x));
+  cell.push_back(GeoPlane(GeoVector(0,1,0),-hi.y));
+  cell.push_back(GeoPlane(GeoVector(0,-1,0),lo.y));
+  cell.push_back(GeoPlane(GeoVector(0,0,1),-hi.z));
+  cell.push_back(GeoPlane(GeoVector(0,0,-1),lo.z));
+
+  PartitionFragments(cell,fragments,&leaves);
+
+  foreach (il, leaves)
+  {
+    if (!BuildLeafSolid(solid,*il,(lo + hi) * 0.5,sqrt((hi - lo) * (hi - lo)) * 2 + 64,&leaf))
+    {
+      GeoPrintMessage("Cutting non-convex solid instead of using a BSP tree, as a leaf of the tree has no volume");
+      DecomposeSolid(solid,solids);
+      return;
+    }
+
+    built.push_back(leaf);
+  }
+
+  GeoPrintMessage("Decomposing non-convex solid");
+  solids->splice(solids->end(),built);
+}
+
+void DecomposeSolidsBSP(list<GeoSolid> *solids)
+{
+  list<GeoSolid>::iterator isolid;
+  list<GeoFace>::iterator iface;
+  list<GeoSolid> leaves;
+  int reflex;
+
+  // the leaves take the place of the solid, as they do when ParallelSolidPass() puts them back
+
+  for (isolid = solids->begin(); isolid != solids->end();)
+  {
+    GeoCurContext->brush = isolid->index;
+
+    if (IsConvexSolid(*isolid))
+    {
+      ++isolid;
+      continue;
+    }
+
+    reflex = 0;
+
+    for (iface = isolid->faces.begin(); iface != isolid->faces.end(); iface++)
+    {
+      if (iface->reflex < 0)
+        iface->reflex = ReflexEdges(*isolid,iface);
+
+      reflex += iface->reflex;
+    }
+
+    if (reflex == 0)
+    {
+      ++isolid;
+      continue;
+    }
+
+    GeoDebugPrintf("Decomposing solid %i with BSP tree, %i reflex edges\n",isolid->index,reflex);
+
+    // DecomposeSolidBSP() says how the solid is decomposed, unless its pieces are replayed from the memo cache
+
+    leaves.clear();
+
+    if (!GeoCurContext->flagDecomposeMemo)
+      DecomposeSolidBSP(*isolid,&leaves);
+    else if (DecomposeMemoSolid(*isolid,&leaves,DecomposeSolidBSP))
+      GeoPrintMessage("Decomposing non-convex solid");
+
+    solids->splice(isolid,leaves);
+    solids->erase(isolid++);
+  }
+}
+
+void DecomposeGroupBSP(GeoGroup *group)
+{
+  list<GeoEntity>::iterator ientity;
+  list<GeoGroup>::iterator igroup;
+
+  StartDecomposeMemo();
+
+  if (GeoCurContext->threads > 0)
+  {
+    ParallelSolidPass(group,DecomposeSolidsBSP);
+    return;
+  }
+
+  GeoCurContext->entity = 0;
+  DecomposeSolidsBSP(&group->solids);
+
+  foreach (ientity, group->entities)
+  {
+    GeoCurContext->entity = ientity->index;
+    DecomposeSolidsBSP(&ientity->solids);
+  }
+
+  foreach (igroup, group->groups)
+    DecomposeGroupBSP(&*igroup);
+}
@@ -0,0 +1,34 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_BSP
+#define _INC_BSP
+
+#include <vector>
+#include "geo.h"
+
+using namespace std;
+
+/*
+Alternative to DecomposeGroup() which partitions each non-convex solid with a BSP tree built from the planes of
+its faces, reflex planes first, and builds each convex leaf cell directly from its bounding planes
+*/
+
+void DecomposeGroupBSP(GeoGroup *group);
+
+/*
+Builds a convex solid from the planes bounding it, giving each face the texture of the face of solid in the same
+plane. center and radius must enclose the result. Returns 0 if the planes don't bound a solid with volume
+*/
+
+int BuildLeafSolid(GeoSolid &solid, const vector<GeoPlane> &planes, const GeoVector &center, double radius, GeoSolid *leaf);
+
+#endif
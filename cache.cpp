@@ -0,0 +1,602 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "geo.h"
+#include "cache.h"
+
+using namespace std;
+
+/*
+File layout, all values in native byte order:
+  "HLFC" magic, key length, key, number of solids, then for each solid:
+    color r g b, visgroup, number of faces, then for each face:
+      texture name length, name, uaxis, vaxis, ushift, vshift, uscale, vscale, rot, number of edges, closed flag,
+      then the start of each edge, followed by its end unless the cycle is closed
+The key is the options followed by the input solid in the same layout, and is compared in full when loading so
+that a hash collision can only cause a miss
+*/
+
+static const char CacheMagic[4] = {'H','L','F','C'};
+
+static void PutBytes(string *s, const void *p, int n)
+{
+  s->append((const char *)p,n);
+}
+
+static void PutInt(string *s, int i)
+{
+  PutBytes(s,&i,sizeof(int));
+}
+
+static void PutVector(string *s, const GeoVector &v)
+{
+  PutBytes(s,&v.x,sizeof(double));
+  PutBytes(s,&v.y,sizeof(double));
+  PutBytes(s,&v.z,sizeof(double));
+}
+
+class CacheReader
+{
+  public:
+  const string &s;
+  unsigned int pos;
+  int ok;
+
+  CacheReader(const string &ts) : s(ts), pos(0), ok(1) {}
+
+  void bytes(void *p, unsigned int n)
+  {
+    if (!ok || s.size() - pos < n)
+    {
+      ok = 0;
+      memset(p,0,n);
+      return;
+    }
+
+    memcpy(p,s.data() + pos,n);
+    pos += n;
+  }
+
+  int integer(void)
+  {
+    int i;
+
+    bytes(&i,sizeof(int));
+    return i;
+  }
+
+  GeoVector vector(void)
+  {
+    GeoVector v;
+
+    bytes(&v.x,sizeof(double));
+    bytes(&v.y,sizeof(double));
+    bytes(&v.z,sizeof(double));
+
+    return v;
+  }
+};
+
+// returns 1 if every edge of the cycle starts exactly where the previous one ended
+static int IsClosedCycle(const list<GeoEdge> &edges)
+{
+  list<GeoEdge>::const_iterator ie, je;
+
+  foreach (ie, edges)
+  {
+    je = ie;
+
+    if (++je == edges.end())
+      je = edges.begin();
+
+    if (memcmp(&ie->v2,&je->v1,sizeof(GeoVector)) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+static int HasNonPlanarFace(const GeoSolid &solid)
+{
+  list<GeoFace>::const_iterator iface;
+
+  foreach (iface, solid.faces)
+    if (!iface->isPlanar())
+      return 1;
+
+  return 0;
+}
+
+// appends a solid to s, returning 0 if it can't be stored because a face has inner cycles
+static int PutSolid(string *s, const GeoSolid &solid)
+{
+  list<GeoFace>::const_iterator iface;
+  list<GeoEdge>::const_iterator ie;
+  char closed;
+  int n;
+
+  PutBytes(s,&solid.color,sizeof(GeoColor));
+  PutInt(s,solid.visgroup);
+  PutInt(s,solid.faces.size());
+
+  foreach (iface, solid.faces)
+  {
+    if (!iface->inedges.empty())
+      return 0;
+
+    n = strlen(iface->tex.texture);
+    PutInt(s,n);
+    PutBytes(s,iface->tex.texture,n);
+    PutVector(s,iface->tex.uaxis);
+    PutVector(s,iface->tex.vaxis);
+    PutBytes(s,&iface->tex.ushift,sizeof(float));
+    PutBytes(s,&iface->tex.vshift,sizeof(float));
+    PutBytes(s,&iface->tex.uscale,sizeof(float));
+    PutBytes(s,&iface->tex.vscale,sizeof(float));
+    PutBytes(s,&iface->tex.rot,sizeof(float));
+    PutInt(s,iface->edges.size());
+
+    // the end of each edge is only stored if it isn't exactly the start of the next
+
+    closed = char(IsClosedCycle(iface->edges));
+    PutBytes(s,&closed,1);
+
+    foreach (ie, iface->edges)
+    {
+      PutVector(s,ie->v1);
+
+      if (!closed)
+        PutVector(s,ie->v2);
+    }
+  }
+
+  return 1;
+}
+
+static int GetSolid(CacheReader *r, GeoSolid *solid)
+{
+  vector<GeoVector> verts;
+  GeoFace face;
+  GeoEdge edge;
+  char closed;
+  int i, j, n, nfaces;
+
+  solid->faces.clear();
+  r->bytes(&solid->color,sizeof(GeoColor));
+  solid->visgroup = r->integer();
+  nfaces = r->integer();
+
+  for (i = 0; i < nfaces && r->ok; i++)
+  {
+    face = GeoFace();
+    face.index = i;
+
+    n = r->integer();
+
+    if (n < 0 || n > 255)
+      return 0;
+
+    r->bytes(face.tex.texture,n);
+    face.tex.texture[n] = '\0';
+    face.tex.uaxis = r->vector();
+    face.tex.vaxis = r->vector();
+    r->bytes(&face.tex.ushift,sizeof(float));
+    r->bytes(&face.tex.vshift,sizeof(float));
+    r->bytes(&face.tex.uscale,sizeof(float));
+    r->bytes(&face.tex.vscale,sizeof(float));
+    r->bytes(&face.tex.rot,sizeof(float));
+
+    n = r->integer();
+    r->bytes(&closed,1);
+
+    if (n < 1 || !r->ok)
+      return 0;
+
+    verts.clear();
+
+    for (j = 0; j < (closed ? n : 2 * n) && r->ok; j++)
+      verts.push_back(r->vector());
+
+    for (j = 0; j < n && r->ok; j++)
+    {
+      edge.v1 = closed ? verts[j] : verts[2 * j];
+      edge.v2 = closed ? verts[(j + 1) % n] : verts[2 * j + 1];
+      edge.index = j;
+      face.edges.push_back(edge);
+    }
+
+    solid->faces.push_back(face);
+  }
+
+  return r->ok;
+}
+
+// FNV-1a
+static unsigned long long CacheHash(const string &s)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  unsigned int i;
+
+  for (i = 0; i < s.size(); i++)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+string GeoSolidCache::path(const string &key)
+{
+  char name[32];
+
+  snprintf(name,sizeof(name),"/%016llx.hlc",CacheHash(key));
+
+  return string(dir) + name;
+}
+
+// numbers the temporary files of this process, which its threads may write at the same time
+static atomic<unsigned int> CacheTempCount(0);
+
+int GeoSolidStore::find(unsigned long long hash, string *data)
+{
+  map<unsigned long long, pair<string, list<unsigned long long>::iterator> >::iterator ientry;
+  lock_guard<mutex> guard(lock);
+
+  if ((ientry = entries.find(hash)) == entries.end())
+    return 0;
+
+  recent.splice(recent.begin(),recent,ientry->second.second);
+  *data = ientry->second.first;
+
+  return 1;
+}
+
+void GeoSolidStore::put(unsigned long long hash, const string &data)
+{
+  map<unsigned long long, pair<string, list<unsigned long long>::iterator> >::iterator ientry;
+  lock_guard<mutex> guard(lock);
+
+  if ((long) data.size() > maxbytes)
+    return;
+
+  if ((ientry = entries.find(hash)) != entries.end())
+  {
+    nbytes -= ientry->second.first.size();
+    recent.erase(ientry->second.second);
+    entries.erase(ientry);
+  }
+
+  while (nbytes + (long) data.size() > maxbytes && !recent.empty())
+  {
+    ientry = entries.find(recent.back());
+    nbytes -= ientry->second.first.size();
+    entries.erase(ientry);
+    recent.pop_back();
+  }
+
+  recent.push_front(hash);
+  entries[hash] = make_pair(data,recent.begin());
+  nbytes += data.size();
+}
+
+static int ReadFile(const char *fn, string *s)
+{
+  char buf[65536];
+  FILE *f;
+  int n;
+
+  if ((f = fopen(fn,"rb")) == NULL)
+    return 0;
+
+  s->clear();
+
+  while ((n = fread(buf,1,sizeof(buf),f)) > 0)
+    s->append(buf,n);
+
+  fclose(f);
+
+  return 1;
+}
+
+// finds the file of key in memory or the directory, keeping a copy in memory of one only found in the directory
+int GeoSolidCache::fetch(const string &key, string *data)
+{
+  if (memory != NULL && memory->find(CacheHash(key),data))
+    return 1;
+
+  if (dir[0] == '\0' || !ReadFile(path(key).c_str(),data))
+    return 0;
+
+  if (memory != NULL)
+    memory->put(CacheHash(key),*data);
+
+  return 1;
+}
+
+void GeoSolidCache::load(list<GeoSolid> *solids)
+{
+  list<GeoSolid>::iterator isolid;
+  list<GeoSolid> pieces;
+  GeoSolid piece;
+  string key, data, stored;
+  int i, n;
+
+  for (isolid = solids->begin(); isolid != solids->end();)
+  {
+    key = options;
+
+    // projecting or tesselating a non-planar face changes the solid sharing it too, so such solids aren't cached
+
+    if ((skipNonPlanar && HasNonPlanarFace(*isolid)) || !PutSolid(&key,*isolid))
+    {
+      ++isolid;
+      continue;
+    }
+
+    if (!fetch(key,&data))
+    {
+      nmisses++;
+      keys[solids][isolid->index] = key;
+      ++isolid;
+      continue;
+    }
+
+    CacheReader r(data);
+    char magic[4];
+
+    r.bytes(magic,4);
+    n = r.integer();
+
+    if (r.ok && n >= 0 && memcmp(magic,CacheMagic,4) == 0 && data.size() - r.pos >= (unsigned int)n)
+    {
+      stored.assign(data,r.pos,n);
+      r.pos += n;
+    }
+    else
+      r.ok = 0;
+
+    pieces.clear();
+
+    if (r.ok && stored == key)
+    {
+      n = r.integer();
+
+      for (i = 0; i < n && r.ok; i++)
+        if (GetSolid(&r,&piece))
+        {
+          piece.index = isolid->index;
+          pieces.push_back(piece);
+        }
+    }
+
+    if (!r.ok || stored != key || r.pos != data.size())
+    {
+      GeoDebugPrintf("  Ignoring invalid cache file for solid %i\n",isolid->index);
+      nmisses++;
+      keys[solids][isolid->index] = key;
+      ++isolid;
+      continue;
+    }
+
+    // mark the file as recently used
+
+    if (dir[0] != '\0')
+      utime(path(key).c_str(),NULL);
+
+    GeoDebugPrintf("  Loaded %i solids for solid %i from the cache\n",int(pieces.size()),isolid->index);
+
+    nhits++;
+    held[solids].splice(held[solids].end(),pieces);
+    solids->erase(isolid++);
+  }
+}
+
+void GeoSolidCache::load(GeoGroup *group)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+
+  load(&group->solids);
+
+  foreach (ientity, group->entities)
+    load(&ientity->solids);
+
+  foreach (igroup, group->groups)
+    load(&*igroup);
+}
+
+void GeoSolidCache::store(list<GeoSolid> *solids)
+{
+  list<GeoSolid>::iterator isolid;
+  map<int, string>::iterator ikey;
+  map<int, list<GeoSolid *> > pieces;
+  map<int, list<GeoSolid *> >::iterator ip;
+  list<GeoSolid *>::iterator ipiece;
+  string data, fn, tmpfn;
+  char suffix[64];
+  FILE *f;
+  int ok;
+
+  map<int, string> &listkeys = keys[solids];
+
+  foreach (isolid, *solids)
+    pieces[isolid->index].push_back(&*isolid);
+
+  foreach (ip, pieces)
+  {
+    if ((ikey = listkeys.find(ip->first)) == listkeys.end())
+      continue;
+
+    data.assign(CacheMagic,4);
+    PutInt(&data,ikey->second.size());
+    data.append(ikey->second);
+    PutInt(&data,ip->second.size());
+    ok = 1;
+
+    foreach (ipiece, ip->second)
+      ok = ok && PutSolid(&data,**ipiece);
+
+    if (!ok)
+      continue;
+
+    if (memory != NULL)
+    {
+      memory->put(CacheHash(ikey->second),data);
+
+      if (dir[0] == '\0')
+      {
+        nstored++;
+        continue;
+      }
+    }
+
+    // write under a name no other process or thread uses, then rename it into place
+
+    fn = path(ikey->second);
+    snprintf(suffix,sizeof(suffix),".%i.%u.tmp",int(getpid()),CacheTempCount++);
+    tmpfn = fn + suffix;
+
+    if ((f = fopen(tmpfn.c_str(),"wb")) == NULL)
+      continue;
+
+    ok = fwrite(data.data(),1,data.size(),f) == data.size();
+    ok = fclose(f) == 0 && ok;
+
+    if (ok && rename(tmpfn.c_str(),fn.c_str()) == 0)
+      nstored++;
+    else
+      remove(tmpfn.c_str());
+  }
+}
+
+void GeoSolidCache::store(GeoGroup *group)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+
+  store(&group->solids);
+
+  foreach (ientity, group->entities)
+    store(&ientity->solids);
+
+  foreach (igroup, group->groups)
+    store(&*igroup);
+}
+
+void GeoSolidCache::restore(list<GeoSolid> *solids)
+{
+  map<list<GeoSolid> *, list<GeoSolid> >::iterator iheld;
+  list<GeoSolid>::iterator isolid;
+
+  if ((iheld = held.find(solids)) == held.end())
+    return;
+
+  // the passes keep solids in the order of their index, so each goes back before the first one after it
+
+  list<GeoSolid> &pieces = iheld->second;
+  isolid = solids->begin();
+
+  while (!pieces.empty())
+  {
+    while (isolid != solids->end() && isolid->index <= pieces.front().index)
+      ++isolid;
+
+    solids->splice(isolid,pieces,pieces.begin());
+  }
+}
+
+void GeoSolidCache::restore(GeoGroup *group)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+
+  restore(&group->solids);
+
+  foreach (ientity, group->entities)
+    restore(&ientity->solids);
+
+  foreach (igroup, group->groups)
+    restore(&*igroup);
+}
+
+class CacheFile
+{
+  public:
+  string path;
+  time_t mtime;
+  long size;
+
+  bool operator<(const CacheFile &f) const
+  {
+    return mtime < f.mtime;
+  }
+};
+
+void GeoSolidCache::evict(void)
+{
+  vector<CacheFile> files;
+  CacheFile file;
+  struct dirent *entry;
+  struct stat st;
+  long total = 0;
+  int i, n;
+  DIR *d;
+
+  if (maxbytes <= 0 || dir[0] == '\0' || (d = opendir(dir)) == NULL)
+    return;
+
+  while ((entry = readdir(d)) != NULL)
+  {
+    n = strlen(entry->d_name);
+
+    if (n < 4 || strcmp(entry->d_name + n - 4,".hlc") != 0)
+      continue;
+
+    file.path = string(dir) + "/" + entry->d_name;
+
+    // another process may have removed it already
+
+    if (stat(file.path.c_str(),&st) != 0)
+      continue;
+
+    file.mtime = st.st_mtime;
+    file.size = st.st_size;
+    total += file.size;
+    files.push_back(file);
+  }
+
+  closedir(d);
+
+  if (total <= maxbytes)
+    return;
+
+  sort(files.begin(),files.end());
+
+  for (i = 0; i < int(files.size()) && total > maxbytes; i++)
+  {
+    if (remove(files[i].path.c_str()) == 0)
+      nevicted++;
+
+    total -= files[i].size;
+  }
+}
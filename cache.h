@@ -0,0 +1,91 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_CACHE
+#define _INC_CACHE
+
+#include <stdio.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include "geo.h"
+
+using namespace std;
+
+/*
+Processed solids kept in memory in the same form as the files of a cache directory, keyed by the hash of their key,
+so that maps converted one after another by the same process can share them. It may be used by several threads,
+and the least recently used entries are dropped when it grows beyond maxbytes
+*/
+
+class GeoSolidStore
+{
+  public:
+  long maxbytes, nbytes;
+
+  GeoSolidStore() : maxbytes(0), nbytes(0) {}
+
+  int find(unsigned long long hash, string *data);
+  void put(unsigned long long hash, const string &data);
+
+  private:
+  mutex lock;
+  list<unsigned long long> recent; // most recently used first
+  map<unsigned long long, pair<string, list<unsigned long long>::iterator> > entries;
+};
+
+/*
+Cache of processed solids kept in a directory across runs. Each input solid is keyed by its contents and the
+options that affect processing, and the solids it was turned into are stored in a file named after the hash of
+the key. Files are written under a temporary name and renamed into place, so several processes can share the
+directory, and the least recently used files are removed when it grows beyond maxbytes. Solids are also looked up in and added to
+memory if it is set, with or without a directory
+*/
+
+class GeoSolidCache
+{
+  public:
+  char dir[FILENAME_MAX+1];
+  GeoSolidStore *memory;
+  string options;
+  long maxbytes;
+  int skipNonPlanar; // leave out solids with non-planar faces, which are projected or tesselated with their neighbours
+  int nhits, nmisses, nstored, nevicted;
+
+  GeoSolidCache() : memory(NULL), maxbytes(0), skipNonPlanar(0), nhits(0), nmisses(0), nstored(0), nevicted(0) {dir[0] = '\0';}
+
+  int enabled(void) {return dir[0] != '\0' || memory != NULL;}
+
+  // removes the solids found in the cache from the map, holding their processed solids until restore()
+  void load(GeoGroup *group);
+
+  // stores the processed solids of those not found by load()
+  void store(GeoGroup *group);
+
+  // puts the solids held by load() back into the map where they were
+  void restore(GeoGroup *group);
+
+  // removes the least recently used files until the directory is no larger than maxbytes
+  void evict(void);
+
+  private:
+  map<list<GeoSolid> *, list<GeoSolid> > held;
+  map<list<GeoSolid> *, map<int, string> > keys; // keys of the solids not found, by list and solid index
+
+  void load(list<GeoSolid> *solids);
+  void store(list<GeoSolid> *solids);
+  void restore(list<GeoSolid> *solids);
+  string path(const string &key);
+  int fetch(const string &key, string *data);
+};
+
+#endif
@@ -9,11 +9,18 @@
 */
 
 #include <cmath>
+#include <ctime>
+#include <algorithm>
 #include <list>
 #include <set>
 #include <map>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "geo.h"
 #include "cd.h"
+#include "kernel.h"
+#include "pool.h"
 
 using namespace std;
 
@@ -29,42 +36,80 @@ If a and b are parallel, the internal angle is considered 360 degrees
 
 double InternalAngle(GeoVector a, GeoVector b, GeoVector norm)
 {
+  int s = GeoTripleSign(a,b,norm);
+
   a.normalize();
   b.normalize();
 
-  if ((a % b) * norm > 0)
+  if (s > 0)
     return 1 - (a * b);
   else
     return 3 + (a * b);
 }
 
-class VertexIsLeftOf
+/*
+Orders angles the same way as InternalAngle() without normalising a and b. The cosine and sine of the angle are
+replaced by a*b and (a%b)*norm divided by |a*b| + |(a%b)*norm|, which still increases monotonically with the
+angle within each half turn. norm must be of unit length. Returns -1 if a or b has zero length.
+*/
+
+double PseudoAngle(const GeoVector &a, const GeoVector &b, const GeoVector &norm)
+{
+  double c, s, t;
+
+  c = a * b;
+  s = (a % b) * norm;
+  t = fabs(c) + fabs(s);
+
+  if (t == 0)
+    return -1;
+
+  if (GeoTripleSign(a,b,norm) > 0)
+    return 1 - c / t;
+  else
+    return 3 + c / t;
+}
+
+/*
+Intersection point on a cut line, with its position along the line. Points are sorted by position with
+stable_sort, so points at the same position keep the order they were found in
+*/
+
+class CutPoint
 {
   public:
-  GeoVector n;
+  double t;
+  GeoVector v;
 
-  VertexIsLeftOf(GeoVector tn) : n(tn) { }
+  CutPoint(const GeoVector &tv, const GeoVector &n) : t(tv*n), v(tv) { }
 
-  bool operator()(const GeoVector &a, const GeoVector &b) const
+  bool operator<(const CutPoint &p) const
   {
-    return a*n < b*n;
+    return t < p.t;
   }
 };
 
-void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdges, list<GeoEdge> *backEdges, list<GeoEdge> *frontPlaneEdges, list<GeoEdge> *backPlaneEdges)
+/*
+sides holds the side of the cut plane of v1 and v2 of every edge of the face, two entries per edge, outer
+cycle first and then each inner cycle in order
+*/
+
+void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, const signed char *sides, list<GeoEdge> *frontEdges, list<GeoEdge> *backEdges, list<GeoEdge> *frontPlaneEdges, list<GeoEdge> *backPlaneEdges)
 {
   list<GeoEdge>::iterator ieFirst, ie, ieBegin, ieEnd;
   list<list<GeoEdge> >::iterator ile;
-  VertexIsLeftOf comp(cutplane.norm % face.norm());
-  multiset<GeoVector,VertexIsLeftOf> backVerts(comp), frontVerts(comp);
-  multiset<GeoVector,VertexIsLeftOf>::iterator vi;
+  GeoVector n = cutplane.norm % face.norm();
+  vector<CutPoint> backVerts, frontVerts;
+  vector<CutPoint>::iterator vi;
+  const signed char *cycle, *side;
   GeoVector v;
   GeoEdge e;
 
   GeoDebugPrintf("      Cut plane is (%gx + %gy + %gz + %g) = 0\n",cutplane.norm.x,cutplane.norm.y,cutplane.norm.z,cutplane.d);
-  GeoDebugPrintf("      Cut line normal is (%g %g %g)\n",comp.n.x,comp.n.y,comp.n.z);
+  GeoDebugPrintf("      Cut line normal is (%g %g %g)\n",n.x,n.y,n.z);
 
   ile = face.inedges.begin();
+  cycle = sides + 2 * face.edges.size();
 
   for (;;)
   {
@@ -72,10 +117,15 @@ void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdg
     {
       ieBegin = ie = face.edges.begin();
       ieEnd = face.edges.end();
+      side = sides;
+
+      while (side[0] == SIDE_IN && side[1] == SIDE_IN)
+      {
+        side += 2;
 
-      while (ie->isIn(cutplane))
         if (++ie == face.edges.end())
           throw new GeoException((char *)"Attempt to cut outer edge cycle which lies entirely within cutting plane");
+      }
 
       GeoDebugPrintf("      Starting at edge %i of outer cycle\n",ie->index);
     }
@@ -83,10 +133,15 @@ void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdg
     {
       ieBegin = ie = ile->begin();
       ieEnd = ile->end();
+      side = cycle;
+
+      while (side[0] == SIDE_IN && side[1] == SIDE_IN)
+      {
+        side += 2;
 
-      while (ie->isIn(cutplane))
         if (++ie == ile->end())
           throw new GeoException((char *)"Attempt to cut inner edge cycle which lies entirely within cutting plane");
+      }
 
       GeoDebugPrintf("      Starting at edge %i of an inner cycle\n",ie->index);
     }
@@ -95,25 +150,25 @@ void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdg
 
     do
     {
-      switch(ie->v1.sideOf(cutplane) * 3 + ie->v2.sideOf(cutplane))
+      switch(side[0] * 3 + side[1])
       {
         case SIDE_BACK*3+SIDE_BACK:
           backEdges->push_back(*ie);
         break;
 
         case SIDE_BACK*3+SIDE_FRONT:
-          v = ie->intersect(cutplane);
+          v = GeoGridSnap(ie->intersect(cutplane));
           backEdges->push_back(GeoEdge(ie->v1,v));
           frontEdges->push_back(GeoEdge(v,ie->v2));
-          backVerts.insert(v);
-          frontVerts.insert(v);
+          backVerts.push_back(CutPoint(v,n));
+          frontVerts.push_back(CutPoint(v,n));
 
           GeoDebugPrintf("        Edge %i crossing to FRONT of cut plane at (%g %g %g)\n",ie->index,v.x,v.y,v.z);
         break;
 
         case SIDE_BACK*3+SIDE_IN:
           backEdges->push_back(*ie);
-          backVerts.insert(ie->v2);
+          backVerts.push_back(CutPoint(ie->v2,n));
 
           GeoDebugPrintf("        Edge %i encounter BACK of cut plane at (%g %g %g)\n",ie->index,ie->v2.x,ie->v2.y,ie->v2.z);
         break;
@@ -123,57 +178,66 @@ void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdg
         break;
 
         case SIDE_FRONT*3+SIDE_BACK:
-          v = ie->intersect(cutplane);
+          v = GeoGridSnap(ie->intersect(cutplane));
           frontEdges->push_back(GeoEdge(ie->v1,v));
           backEdges->push_back(GeoEdge(v,ie->v2));
-          frontVerts.insert(v);
-          backVerts.insert(v);
+          frontVerts.push_back(CutPoint(v,n));
+          backVerts.push_back(CutPoint(v,n));
 
           GeoDebugPrintf("        Edge %i crossing to BACK of cut plane at (%g %g %g)\n",ie->index,v.x,v.y,v.z);
         break;
 
         case SIDE_FRONT*3+SIDE_IN:
           frontEdges->push_back(*ie);
-          frontVerts.insert(ie->v2);
+          frontVerts.push_back(CutPoint(ie->v2,n));
 
           GeoDebugPrintf("        Edge %i encounter FRONT of cut plane at (%g %g %g)\n",ie->index,ie->v2.x,ie->v2.y,ie->v2.z);
         break;
 
         case SIDE_IN*3+SIDE_FRONT:
           frontEdges->push_back(*ie);
-          frontVerts.insert(ie->v1);
+          frontVerts.push_back(CutPoint(ie->v1,n));
 
           GeoDebugPrintf("        Edge %i leaving FRONT of cut plane at (%g %g %g)\n",ie->index,ie->v1.x,ie->v1.y,ie->v1.z);
         break;
 
         case SIDE_IN*3+SIDE_BACK:
           backEdges->push_back(*ie);
-          backVerts.insert(ie->v1);
+          backVerts.push_back(CutPoint(ie->v1,n));
 
           GeoDebugPrintf("        Edge %i leaving BACK of cut plane at (%g %g %g)\n",ie->index,ie->v1.x,ie->v1.y,ie->v1.z);
         break;
       }
 
+      side += 2;
+
       if (++ie == ieEnd)
+      {
         ie = ieBegin;
+        side = ile == face.inedges.end() ? sides : cycle;
+      }
     }
     while (ie != ieFirst);
 
     if (ile == face.inedges.end())
       break;
 
+    cycle += 2 * ile->size();
     ++ile;
   }
 
+  stable_sort(frontVerts.begin(),frontVerts.end());
+  stable_sort(backVerts.begin(),backVerts.end());
+
   GeoDebugPrintf("\n      Generating edges for %i front intersection points\n", frontVerts.size());
 
   if (frontVerts.size() & 1) throw new GeoException((char *)"Odd number of front intersection points");
 
   for (vi = frontVerts.begin(); vi != frontVerts.end();)
   {
-    e.v1 = *vi;
+    e.v1 = vi->v;
     vi++;
-    e.v2 = *vi;
+    e.v2 = vi->v;
     vi++;
 
     if (e.v1 == e.v2)
@@ -195,9 +259,9 @@ void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdg
 
   for (vi = backVerts.begin(); vi != backVerts.end();)
   {
-    e.v2 = *vi;
+    e.v2 = vi->v;
     vi++;
-    e.v1 = *vi;
+    e.v1 = vi->v;
     vi++;
 
     if (e.v1 == e.v2)
@@ -214,16 +278,58 @@ void GenerateCutEdges(GeoFace &face, GeoPlane &cutplane, list<GeoEdge> *frontEdg
   }
 }
 
-void FindAdjacentEdges(list<GeoEdge> *edges, list<GeoEdge>::iterator ieStart, list<GeoEdge> *inedges, GeoVector norm)
+/*
+Edges handed to GenerateFaces, indexed by the grid cell of their start vertex so that assembling an edge cycle
+only has to look at the edges leaving the current vertex
+*/
+
+class OutgoingEdges
 {
-  list<GeoEdge>::iterator ieAdjacent, ie;
+  public:
+  vector<GeoEdge> edges;
+  vector<char> used;
+  map<GeoVertexKey, vector<int> > cells;
+
+  OutgoingEdges(const list<GeoEdge> &tedges)
+  {
+    list<GeoEdge>::const_iterator ie;
+    GeoVertexKey keys[8];
+    int i, n;
+
+    edges.assign(tedges.begin(),tedges.end());
+    used.assign(edges.size(),0);
+
+    for (i = 0; i < int(edges.size()); i++)
+    {
+      n = GeoVertexCells(edges[i].v1,keys);
+
+      while (n-- > 0)
+        cells[keys[n]].push_back(i);
+    }
+  }
+
+  // returns the indexes of the edges which might start at v, in their original order
+  const vector<int> *from(const GeoVector &v) const
+  {
+    map<GeoVertexKey, vector<int> >::const_iterator icell;
+
+    icell = cells.find(GeoVertexCell(v));
+
+    return icell == cells.end() ? NULL : &icell->second;
+  }
+};
+
+void FindAdjacentEdges(OutgoingEdges *out, int start, list<GeoEdge> *inedges, GeoVector norm)
+{
+  const vector<int> *cell;
+  vector<int>::const_iterator ii;
   GeoEdge edge;
   GeoVector v;
   double aAdjacent, a;
-  int index;
+  int iAdjacent, index;
 
-  edge = *ieStart;
-  edges->erase(ieStart);
+  edge = out->edges[start];
+  out->used[start] = 1;
   edge.index = 0;
   inedges->push_back(edge);
 
@@ -236,26 +342,35 @@ void FindAdjacentEdges(list<GeoEdge> *edges, list<GeoEdge>::iterator ieStart, li
   while (edge.v2 != v)
   {
     aAdjacent = 999.0;
+    iAdjacent = -1;
 
-    for (ie = edges->begin(); ie != edges->end(); ie++)
+    if ((cell = out->from(edge.v2)) != NULL)
     {
-      a = InternalAngle(ie->vec(),edge.rvec(),norm);
+      foreach (ii, *cell)
+      {
+        const GeoEdge &e = out->edges[*ii];
 
-      GeoDebugPrintf("          Testing edge (%g %g %g) to (%g %g %g) with internal angle %g\n",ie->v1.x,ie->v1.y,ie->v1.z,ie->v2.x,ie->v2.y,ie->v2.z,a);
+        if (out->used[*ii] || e.v1 != edge.v2)
+          continue;
 
-      if (ie->v1 == edge.v2 && a < aAdjacent)
-      {
-        GeoDebugPrintf("            Edge is adjacent and has smallest angle so far\n");
-        aAdjacent = a;
-        ieAdjacent = ie;
+        a = PseudoAngle(e.vec(),edge.rvec(),norm);
+
+        GeoDebugPrintf("          Testing edge (%g %g %g) to (%g %g %g) with internal angle %g\n",e.v1.x,e.v1.y,e.v1.z,e.v2.x,e.v2.y,e.v2.z,a);
+
+        if (a >= 0 && a < aAdjacent)
+        {
+          GeoDebugPrintf("            Edge is adjacent and has smallest angle so far\n");
+          aAdjacent = a;
+          iAdjacent = *ii;
+        }
       }
     }
 
-    if (aAdjacent == 999.0)
+    if (iAdjacent < 0)
       throw new GeoException((char *)"Attempt to assemble incomplete edge cycle");
 
-    edge = *ieAdjacent;
-    edges->erase(ieAdjacent);
+    edge = out->edges[iAdjacent];
+    out->used[iAdjacent] = 1;
     edge.index = index++;
     inedges->push_back(edge);
 
@@ -278,7 +393,10 @@ void FindTexture(GeoFace *face, list<GeoFace> *faces)
   list<GeoFace>::iterator jface, ifaceIn;
   list<GeoEdge>::iterator ie, je;
   list<GeoEdge>::iterator ile;
-  int onBoundary, inFaces;;
+  GeoFacePolygon polygon(*face);
+  vector<GeoVector> points;
+  vector<char> inside;
+  int i, onBoundary, inFaces;;
 
   GeoDebugPrintf("      Finding texture for face %i\n", face->index);
 
@@ -305,11 +423,16 @@ void FindTexture(GeoFace *face, list<GeoFace> *faces)
     }
     else
     {
+      points.clear();
+
       foreach (je, jface->edges)
-        if (je->v1.isIn(*face))
-          break;
+        points.push_back(je->v1);
+
+      polygon.isIn(points,&inside);
 
-      if (je != jface->edges.end() && face->tex != jface->tex)
+      for (i = 0; i < int(inside.size()) && !inside[i]; i++);
+
+      if (i < int(inside.size()) && face->tex != jface->tex)
       {
         GeoDebugPrintf("        Found contained face with texture [%s]\n",jface->tex.texture);
 
@@ -331,6 +454,8 @@ void FindTexture(GeoFace *face, list<GeoFace> *faces)
 void FindNestingStructure(list<GeoFace> *faces, const GeoVector &norm)
 {
   list<GeoFace>::iterator iface, jface;
+  map<const GeoFace *, GeoFacePolygon> polygons; // projected outer cycles, built as they are first needed
+  map<const GeoFace *, GeoFacePolygon>::iterator ipolygon;
 
   for (iface = faces->begin(); iface != faces->end();)
   {
@@ -340,11 +465,18 @@ void FindNestingStructure(list<GeoFace> *faces, const GeoVector &norm)
 
       foreach (jface,*faces) // search for its containing outer cycle
       {
-        if (jface->norm() * norm > 0 && iface->edges.front().v1.isIn(*jface)) // if this is an outer edge cycle and it contains a vertex of the inner cycle
+        if (jface->norm() * norm <= 0) // skip other inner cycles
+          continue;
+
+        if ((ipolygon = polygons.find(&*jface)) == polygons.end())
+          ipolygon = polygons.insert(make_pair(&*jface,GeoFacePolygon(*jface))).first;
+
+        if (ipolygon->second.isIn(iface->edges.front().v1)) // if this outer edge cycle contains a vertex of the inner cycle
         {
           GeoDebugPrintf("        Found matching containing cycle\n");
 
           jface->inedges.push_back(iface->edges);
+          ipolygon->second.addInner(jface->inedges.back(),jface->norm());
           break;
         }
       }
@@ -363,15 +495,21 @@ void GenerateFaces(list<GeoEdge> *edges, GeoVector norm, list<GeoFace> *faces, c
 {
   GeoFace face;
   list<GeoFace> myfaces;
+  OutgoingEdges out(*edges);
+  int i;
 
   face.tex = tex;
+  edges->clear();
 
-  while (!edges->empty())
+  for (i = 0; i < int(out.edges.size()); i++)
   {
+    if (out.used[i])
+      continue;
+
     GeoDebugPrintf("      Starting new face:\n");
 
     face.edges.clear();
-    FindAdjacentEdges(edges,edges->begin(),&face.edges,norm);
+    FindAdjacentEdges(&out,i,&face.edges,norm);
 
     if (face.edges.size() > 2) // don't add degenerate faces with only 2 edges
       myfaces.push_back(face);
@@ -451,92 +589,375 @@ int FindAdjacentFace(list<GeoFace> *faces, const list<GeoFace>::iterator &iface,
   }
 }
 
-void FindAdjacentFaces(list<GeoFace> *faces, list<GeoFace>::iterator iface, int *index)
+/*
+Every edge (outer and inner cycles) of a list of faces, indexed by the grid cell of its start vertex. Built once by
+GenerateSolids so that finding the face on the other side of an edge is a single lookup instead of a scan over all
+faces and edges.
+*/
+
+class FaceEdgeIndex
 {
-  list<GeoEdge>::iterator ie;
-  list<list<GeoEdge> >::iterator ile;
-  list<GeoFace>::iterator ifAdjacent;
+  public:
+  class Ref
+  {
+    public:
+    int face;
+    const GeoEdge *edge;
+
+    Ref(int tface, const GeoEdge *tedge) : face(tface), edge(tedge) {}
+  };
 
-  iface->index = (*index)++;
-  iface->flag = 1;
+  vector<list<GeoFace>::iterator> faces;
+  map<GeoVertexKey, vector<Ref> > cells;
 
-  GeoDebugPrintf("        Adding face with normal (%g %g %g)\n",iface->norm().x,iface->norm().y,iface->norm().z);
+  FaceEdgeIndex(list<GeoFace> *tfaces)
+  {
+    list<GeoFace>::iterator iface;
+    list<GeoEdge>::const_iterator ie;
+    list<list<GeoEdge> >::const_iterator ile;
+    int i = 0;
 
-  foreach (ile,iface->inedges)
-    foreach (ie,*ile)
-      if (FindAdjacentFace(faces,iface,ie,&ifAdjacent,NULL) && !ifAdjacent->flag)
-        FindAdjacentFaces(faces,ifAdjacent,index);
+    foreach (iface, *tfaces)
+    {
+      faces.push_back(iface);
 
-   foreach (ie,iface->edges)
-      if (FindAdjacentFace(faces,iface,ie,&ifAdjacent,NULL) && !ifAdjacent->flag)
-        FindAdjacentFaces(faces,ifAdjacent,index);
-}
+      foreach (ie, iface->edges)
+        add(i,&*ie);
 
-void GenerateSolids(list<GeoFace> *faces, list<GeoSolid> *solids, GeoColor color, int visgroup, int index)
-{
-  GeoSolid solid;
-  list<GeoFace>::iterator iface, jface;
-  list<GeoEdge>::iterator iedge, jedge;
-  list<list<GeoEdge> >::iterator iledge;
-  int found, nfaces = 0, findex;
+      foreach (ile, iface->inedges)
+        foreach (ie, *ile)
+          add(i,&*ie);
+
+      ++i;
+    }
+  }
 
-  for (iface = faces->begin(); iface != faces->end(); iface++)
+  void add(int face, const GeoEdge *edge)
   {
-    nfaces++;
-    iface->flag = 0;
+    GeoVertexKey keys[8];
+    int n;
+
+    n = GeoVertexCells(edge->v1,keys);
+
+    while (n-- > 0)
+      cells[keys[n]].push_back(Ref(face,edge));
   }
 
-  GeoDebugPrintf("      Generating solids for %i faces\n",nfaces);
+  /*
+  Same as FindAdjacentFace: returns the face with the smallest internal angle to face iface across edge e,
+  considering only faces whose owner is -1 or owner, or -1 if there is none
+  */
 
-  while (nfaces > 0)
+  int adjacent(int iface, const GeoEdge &e, const vector<int> &owners, int owner)
   {
-    GeoDebugPrintf("      Starting solid\n");
+    map<GeoVertexKey, vector<Ref> >::iterator icell;
+    vector<Ref>::iterator ir;
+    double a, aAdjacent = 999;
+    int found = -1;
 
-    solid.faces.clear();
-    findex = 0;
-    FindAdjacentFaces(faces,faces->begin(),&findex);
+    if ((icell = cells.find(GeoVertexCell(e.v2))) == cells.end())
+      return -1;
 
-    for (iface = faces->begin(); iface != faces->end();)
+    foreach (ir, icell->second)
     {
-      if (iface->flag)
+      if ((owners[ir->face] != -1 && owners[ir->face] != owner) || !ir->edge->isReverse(e))
+        continue;
+
+      a = InternalAngle(faces[iface]->norm(),-faces[ir->face]->norm(),ir->edge->vec());
+
+      GeoDebugPrintf("          Found adjacent face (%g %g %g) with internal angle %g\n",faces[ir->face]->norm().x,faces[ir->face]->norm().y,faces[ir->face]->norm().z,a);
+
+      if (a < aAdjacent)
       {
-        solid.faces.push_back(*iface);
-        jface = iface++;
-        faces->erase(jface);
-        nfaces--;
+        aAdjacent = a;
+        found = ir->face;
       }
+    }
+
+    return found;
+  }
+
+  // returns 1 if some face belonging to owner has the reverse of edge e
+  int hasReverse(const GeoEdge &e, const vector<int> &owners, int owner)
+  {
+    map<GeoVertexKey, vector<Ref> >::iterator icell;
+    vector<Ref>::iterator ir;
+
+    if ((icell = cells.find(GeoVertexCell(e.v2))) == cells.end())
+      return 0;
+
+    foreach (ir, icell->second)
+      if (owners[ir->face] == owner && ir->edge->isReverse(e))
+        return 1;
+
+    return 0;
+  }
+};
+
+/*
+Assigns owner to every face connected to face start. Faces are visited depth first in the same order as a
+recursive search would (inner cycles first, then the outer cycle) but with an explicit stack.
+*/
+
+class FaceSearchFrame
+{
+  public:
+  int face;
+  list<list<GeoEdge> >::iterator ile;
+  list<GeoEdge>::iterator ie;
+};
+
+void FindAdjacentFaces(FaceEdgeIndex *index, int start, vector<int> *owners, int owner, int *findex)
+{
+  vector<FaceSearchFrame> stack;
+  FaceSearchFrame frame;
+  list<GeoFace>::iterator iface;
+  int adjacent;
+
+  for (;;)
+  {
+    if (start >= 0)
+    {
+      iface = index->faces[start];
+      iface->index = (*findex)++;
+      (*owners)[start] = owner;
+
+      GeoDebugPrintf("        Adding face with normal (%g %g %g)\n",iface->norm().x,iface->norm().y,iface->norm().z);
+
+      frame.face = start;
+      frame.ile = iface->inedges.begin();
+
+      if (frame.ile != iface->inedges.end())
+        frame.ie = frame.ile->begin();
       else
-        iface++;
+        frame.ie = iface->edges.begin();
+
+      stack.push_back(frame);
+      start = -1;
     }
 
-    for (iface = solid.faces.begin(); iface != solid.faces.end(); iface++)
+    if (stack.empty())
+      break;
+
+    FaceSearchFrame &top = stack.back();
+    iface = index->faces[top.face];
+
+    // step to the next edge, moving on from each inner cycle in turn to the outer cycle
+
+    while (top.ile != iface->inedges.end() && top.ie == top.ile->end())
     {
-      for (iedge = iface->edges.begin(); iedge != iface->edges.end(); iedge++)
-      {
-        found = 0;
+      if (++top.ile != iface->inedges.end())
+        top.ie = top.ile->begin();
+      else
+        top.ie = iface->edges.begin();
+    }
 
-        for (jface = solid.faces.begin(); found == 0 && jface != solid.faces.end(); jface++)
-        {
-          for (jedge = jface->edges.begin(); found == 0 && jedge != jface->edges.end(); jedge++)
-            if (iedge->isReverse(*jedge))
-              found = 1;
-
-          for (iledge = jface->inedges.begin(); found == 0 && iledge != jface->inedges.end(); iledge++)
-            for (jedge = iledge->begin(); found == 0 && jedge != iledge->end(); jedge++)
-              if (iedge->isReverse(*jedge))
-                found = 1;
-        }
+    if (top.ile == iface->inedges.end() && top.ie == iface->edges.end())
+    {
+      stack.pop_back();
+      continue;
+    }
+
+    adjacent = index->adjacent(top.face,*top.ie,*owners,owner);
+    ++top.ie;
+
+    if (adjacent >= 0 && (*owners)[adjacent] == -1)
+      start = adjacent;
+  }
+}
+
+void GenerateSolids(list<GeoFace> *faces, list<GeoSolid> *solids, GeoColor color, int visgroup, int index)
+{
+  GeoSolid solid;
+  FaceEdgeIndex edgeIndex(faces);
+  vector<int> owners(edgeIndex.faces.size(),-1);
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator iedge;
+  int i, j, nsolids, findex;
+
+  GeoDebugPrintf("      Generating solids for %i faces\n",int(edgeIndex.faces.size()));
+
+  for (i = nsolids = 0; i < int(edgeIndex.faces.size()); i++)
+  {
+    if (owners[i] != -1)
+      continue;
+
+    GeoDebugPrintf("      Starting solid\n");
+
+    findex = 0;
+    FindAdjacentFaces(&edgeIndex,i,&owners,nsolids,&findex);
+
+    solid.faces.clear();
+
+    for (j = i; j < int(edgeIndex.faces.size()); j++)
+      if (owners[j] == nsolids)
+        solid.faces.push_back(*edgeIndex.faces[j]);
 
-        if (!found)
+    foreach (iface, solid.faces)
+      foreach (iedge, iface->edges)
+        if (!edgeIndex.hasReverse(*iedge,owners,nsolids))
           throw new GeoException((char *)"Orphaned face %i [%s] with normal (%g %g %g)",iface->index,iface->tex.texture,iface->norm().x,iface->norm().y,iface->norm().z);
-      }
-    }
 
     solid.color = color;
     solid.visgroup = visgroup;
     solid.index = index;
     solids->push_back(solid);
+
+    ++nsolids;
+  }
+
+  faces->clear();
+}
+
+/*
+Returns SIDE_FRONT or SIDE_BACK if every vertex of the face lies strictly on that side of the plane,
+otherwise SIDE_IN (the face touches or crosses the plane). sides is laid out as for GenerateCutEdges
+*/
+
+int SideOfPlane(const signed char *sides, int nsides)
+{
+  int i;
+
+  for (i = 0; i < nsides; i += 2)
+    if (sides[i] == SIDE_IN || sides[i] != sides[0])
+      return SIDE_IN;
+
+  return sides[0];
+}
+
+// returns 1 if every outer vertex of the face lies within the plane
+int IsInPlane(const GeoFace &face, const signed char *sides)
+{
+  int i, n;
+
+  n = 2 * face.edges.size();
+
+  for (i = 0; i < n; i += 2)
+    if (sides[i] != SIDE_IN)
+      return 0;
+
+  return 1;
+}
+
+// coordinates of v in the coordinate plane across axis, ordered so that turning counterclockwise in them is along +axis
+static inline void ProjectVector(const GeoVector &v, int axis, double *u, double *w)
+{
+  if (axis == 0)
+  {
+    *u = v.y;
+    *w = v.z;
+  }
+  else if (axis == 1)
+  {
+    *u = v.z;
+    *w = v.x;
+  }
+  else
+  {
+    *u = v.x;
+    *w = v.y;
+  }
+}
+
+/*
+Finds three outer vertices of the face which span its plane for the exact predicates: the lowest vertex in the
+coordinate plane the face is most nearly parallel to, which is always a convex corner, and its neighbours. They turn
+counterclockwise seen from in front of the face, so GeoOrient3D(p[0],p[1],p[2],v) is 1 for v in front of it.
+Returns 0 if the corner is degenerate
+*/
+
+static int FacePlanePoints(GeoFace &face, GeoVector *p)
+{
+  list<GeoEdge>::iterator ie, ilow, iprev;
+  GeoVector n;
+  double u, w, ulow, wlow, u0, w0, u2, w2, nd;
+  int axis;
+
+  if (face.edges.size() < 3)
+    return 0;
+
+  n = face.norm();
+
+  if (fabs(n.x) >= fabs(n.y) && fabs(n.x) >= fabs(n.z))
+  {
+    axis = 0;
+    nd = n.x;
+  }
+  else if (fabs(n.y) >= fabs(n.z))
+  {
+    axis = 1;
+    nd = n.y;
+  }
+  else
+  {
+    axis = 2;
+    nd = n.z;
+  }
+
+  ilow = face.edges.begin();
+  ProjectVector(ilow->v1,axis,&ulow,&wlow);
+
+  foreach (ie, face.edges)
+  {
+    ProjectVector(ie->v1,axis,&u,&w);
+
+    if (u < ulow || (u == ulow && w < wlow))
+    {
+      ulow = u;
+      wlow = w;
+      ilow = ie;
+    }
+  }
+
+  iprev = ilow;
+
+  if (iprev == face.edges.begin())
+    iprev = face.edges.end();
+
+  --iprev;
+
+  p[0] = iprev->v1;
+  p[1] = ilow->v1;
+  p[2] = ilow->v2;
+
+  ProjectVector(p[0],axis,&u0,&w0);
+  ProjectVector(p[2],axis,&u2,&w2);
+
+  return GeoOrient2D(u0,w0,ulow,wlow,u2,w2) == (nd > 0 ? 1 : -1);
+}
+
+// sign of the normal of the face along n, taken from the vertices of the face where they allow it
+static int FaceSideSign(GeoFace &face, const GeoVector &n)
+{
+  GeoVector p[3], zero(0,0,0);
+
+  if (FacePlanePoints(face,p))
+    return GeoTripleSign(p[0],p[1],p[0],p[2],zero,n);
+
+  return face.norm() * n > 0 ? 1 : -1;
+}
+
+// appends v1 and v2 of every edge of the face to points, in the layout GenerateCutEdges expects
+int GatherFacePoints(const GeoFace &face, GeoPointArray *points)
+{
+  list<GeoEdge>::const_iterator ie;
+  list<list<GeoEdge> >::const_iterator ile;
+  int n = points->size();
+
+  foreach (ie, face.edges)
+  {
+    points->push_back(ie->v1);
+    points->push_back(ie->v2);
   }
+
+  foreach (ile, face.inedges)
+    foreach (ie, *ile)
+    {
+      points->push_back(ie->v1);
+      points->push_back(ie->v2);
+    }
+
+  return points->size() - n;
 }
 
 void CutSolid(GeoSolid &solid, GeoPlane cutplane, list<GeoSolid> *cutsolids)
@@ -544,24 +965,52 @@ void CutSolid(GeoSolid &solid, GeoPlane cutplane, list<GeoSolid> *cutsolids)
   list<GeoEdge> edgesFaceFront, edgesFaceBack, edgesCutFront, edgesCutBack;
   list<GeoFace> facesFront, facesBack, facesCutFront, facesCutBack, facesOldCutFront, facesOldCutBack;
   list<GeoFace>::iterator iface;
+  GeoPointArray points;
+  vector<signed char> sides;
+  vector<int> offsets, counts;
   GeoTexture tex;
+  int i, side;
 
-  for (iface = solid.faces.begin(); iface != solid.faces.end(); iface++)
+  // classify every vertex of the solid against the cut plane in one pass
+
+  ++GeoCurContext->decompose.ncuts;
+
+  foreach (iface, solid.faces)
+  {
+    offsets.push_back(points.size());
+    counts.push_back(GatherFacePoints(*iface,&points));
+  }
+
+  sides.resize(points.size());
+  GeoClassifyPoints(points,cutplane,&sides[0]);
+
+  for (iface = solid.faces.begin(), i = 0; iface != solid.faces.end(); iface++, i++)
   {
-    if (iface->isIn(cutplane))
+    if (IsInPlane(*iface,&sides[offsets[i]]))
     {
-      if (iface->norm() * cutplane.norm > 0)
+      if (FaceSideSign(*iface,cutplane.norm) > 0)
         facesOldCutBack.push_back(*iface);
       else
         facesOldCutFront.push_back(*iface);
     }
+    else if ((side = SideOfPlane(&sides[offsets[i]],counts[i])) != SIDE_IN)
+    {
+      // face doesn't touch the cut plane, so it and its cached reflex edge count carry over unchanged
+
+      GeoDebugPrintf("\n    Keeping face %i [%s] on %s of cut plane\n", iface->index,iface->tex.texture,side == SIDE_FRONT ? "FRONT" : "BACK");
+
+      if (side == SIDE_FRONT)
+        facesFront.push_back(*iface);
+      else
+        facesBack.push_back(*iface);
+    }
     else
     {
       GeoDebugPrintf("\n    Cutting face %i [%s] [%lg %lg %lg]\n", iface->index,iface->tex.texture,iface->norm().x,iface->norm().y,iface->norm().z);
 
       edgesFaceFront.clear();
       edgesFaceBack.clear();
-      GenerateCutEdges(*iface,cutplane,&edgesFaceFront,&edgesFaceBack,&edgesCutFront,&edgesCutBack);
+      GenerateCutEdges(*iface,cutplane,&sides[offsets[i]],&edgesFaceFront,&edgesFaceBack,&edgesCutFront,&edgesCutBack);
 
       GeoDebugPrintf("\n      Generating faces for front edges\n");
 
@@ -612,29 +1061,67 @@ void CutSolid(GeoSolid &solid, GeoPlane cutplane, list<GeoSolid> *cutsolids)
   GenerateSolids(&facesBack,cutsolids,solid.color,solid.visgroup,solid.index);
 }
 
-// return number of edges in iface that are reflex
-int ReflexEdges(GeoSolid &solid, list<GeoFace>::iterator iface)
-{
-  list<GeoFace>::iterator jface;
-  list<GeoEdge>::iterator ie, je;
-  list<list<GeoEdge> >::iterator ile;
-  GeoVector ni, nj;
-  int n = 0;
-
-  ni = iface->norm();
+/*
+Returns 1 if the edge e of iface, which jface shares, is reflex. The vertex of jface farthest from the edge is
+tested against the plane through pi with the exact predicates, allowing for which side of the edge it lies on in
+case jface isn't convex. The face normals decide instead if either face is too degenerate for that
+*/
 
-  GeoDebugPrintf("    Face normal: (%lg %lg %lg)\n",ni.x, ni.y, ni.z);
+static int IsReflexEdge(GeoFace &iface, const GeoVector *pi, int planar, const GeoEdge &e, GeoFace &jface)
+{
+  list<GeoEdge>::iterator je;
+  GeoVector v, w, zero(0,0,0);
+  double d, dmax;
 
-  foreach (ie, iface->edges)
+  if (planar)
   {
-    if (!FindAdjacentFace(&solid.faces, iface, ie, &jface, &je))
-      throw new GeoException((char *)"Incomplete solid");
+    dmax = 0;
 
-    nj = jface->norm();
+    foreach (je, jface.edges)
+    {
+      v = (je->v1 - e.v1) % e.vec();
+      d = v * v;
+
+      if (d > dmax)
+      {
+        dmax = d;
+        w = je->v1;
+      }
+    }
+
+    // jface lies to the left of the edge, which it runs along from v2 to v1
+
+    if (dmax > 0 && !GeoColinear(e.v1,e.v2,w))
+      return GeoOrient3D(pi[0],pi[1],pi[2],w) * GeoTripleSign(e.v2,e.v1,e.v2,w,zero,jface.norm()) > 0;
+  }
+
+  return GeoTripleSign(zero,iface.norm(),zero,jface.norm(),e.v1,e.v2) < 0;
+}
+
+// return number of edges in iface that are reflex
+int ReflexEdges(GeoSolid &solid, list<GeoFace>::iterator iface)
+{
+  list<GeoFace>::iterator jface;
+  list<GeoEdge>::iterator ie, je;
+  list<list<GeoEdge> >::iterator ile;
+  GeoVector ni, nj, pi[3];
+  int planar, n = 0;
+
+  ni = iface->norm();
+  planar = FacePlanePoints(*iface,pi);
+
+  GeoDebugPrintf("    Face normal: (%lg %lg %lg)\n",ni.x, ni.y, ni.z);
+
+  foreach (ie, iface->edges)
+  {
+    if (!FindAdjacentFace(&solid.faces, iface, ie, &jface, &je))
+      throw new GeoException((char *)"Incomplete solid");
+
+    nj = jface->norm();
 
     GeoDebugPrintf("      Found adjacent face %i (%lg %lg %lg)",jface->index,nj.x,nj.y,nj.z);
 
-    if ((ni % nj) * ie->vec() < 0)
+    if (IsReflexEdge(*iface,pi,planar,*ie,*jface))
     {
       GeoDebugPrintf(" reflex edge found\n");
 
@@ -655,7 +1142,7 @@ int ReflexEdges(GeoSolid &solid, list<GeoFace>::iterator iface)
 
       GeoDebugPrintf("      Found adjacent face %i (%lg %lg %lg)",jface->index,nj.x,nj.y,nj.z);
 
-      if ((ni % nj) * ie->vec() < 0)
+      if (IsReflexEdge(*iface,pi,planar,*ie,*jface))
       {
         GeoDebugPrintf(" reflex edge found\n");
 
@@ -691,74 +1178,889 @@ int PlaneIsLessThan(const GeoPlane &planea, const GeoPlane &planeb)
     return 0;
 }
 
-void DecomposeSolids(list<GeoSolid> *solids)
+/*
+Cheap convexity test: a solid is convex if none of its vertices lies in front of any of its face planes.
+The vertices are copied into flat coordinate arrays first so the inner loop is a plain multiply-add over
+contiguous data which the compiler can vectorise. Uses the same tolerance as GeoVector::sideOf(), but since the
+plane of a face only planar within tolerance is an average, a vertex beyond it only counts once the exact predicate
+agrees it is in front of the vertices of the face.
+*/
+
+int IsConvexSolid(GeoSolid &solid)
 {
-  list<GeoSolid>::iterator isolid;
-  list<GeoFace>::iterator iface, ifaceCut;
-  map<GeoPlane,int,typeof(PlaneIsLessThan)*> reflexEdges(PlaneIsLessThan);
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<list<GeoEdge> >::iterator ile;
+  vector<double> x, y, z;
   GeoPlane plane;
-  int r, rmax, nsolids;
+  GeoVector p[3];
+  double nx, ny, nz, d, eps = GeoCurContext->epsilon;
+  int i, n, front;
 
-  nsolids = solids->size();
+  foreach (iface, solid.faces)
+  {
+    foreach (ie, iface->edges)
+    {
+      x.push_back(ie->v1.x);
+      y.push_back(ie->v1.y);
+      z.push_back(ie->v1.z);
+    }
 
-  for (isolid = solids->begin(); isolid != solids->end();)
+    foreach (ile, iface->inedges)
+      foreach (ie, *ile)
+      {
+        x.push_back(ie->v1.x);
+        y.push_back(ie->v1.y);
+        z.push_back(ie->v1.z);
+      }
+  }
+
+  n = x.size();
+
+  foreach (iface, solid.faces)
   {
-    GeoDebugPrintf("Decomposing Solid:\n  Finding reflex edges:\n");
+    plane = iface->plane();
+    nx = plane.norm.x;
+    ny = plane.norm.y;
+    nz = plane.norm.z;
+    d = plane.d;
+    front = 0;
 
-    GeoCurBrush = isolid->index;
-    rmax = 0;
-    reflexEdges.clear();
+    for (i = 0; i < n; i++)
+      front |= -(x[i]*nx + y[i]*ny + z[i]*nz) - d < -eps;
 
-    for (iface = isolid->faces.begin(); iface != isolid->faces.end(); iface++)
+    if (front && FacePlanePoints(*iface,p))
     {
-      GeoDebugPrintf("\n    Testing reflex edges for face %i [%s]\n",iface->index, iface->tex.texture);
+      front = 0;
 
-      plane = iface->plane();
+      for (i = 0; i < n && !front; i++)
+        front = -(x[i]*nx + y[i]*ny + z[i]*nz) - d < -eps && GeoOrient3D(p[0],p[1],p[2],GeoVector(x[i],y[i],z[i])) > 0;
+    }
 
-      r = ReflexEdges(*isolid,iface);
+    if (front)
+      return 0;
+  }
 
-      if (reflexEdges.find(plane) == reflexEdges.end())
-        reflexEdges[plane] = r;
-      else
-        r = (reflexEdges[plane] += r);
+  return 1;
+}
 
-      GeoDebugPrintf("    Plane [%lg %lg %lg %lg] now has %i reflex edges\n",plane.norm.x,plane.norm.y,plane.norm.z,plane.d,r);
+class CutCandidate
+{
+  public:
+  list<GeoFace>::iterator face; // first face lying in the plane
+  int reflex; // reflex edges lying in the plane, all of which the cut resolves
+  int split, front, back; // faces the cut would split or leave wholly in front or behind
+  double score;
+};
 
-      if (r > rmax)
-      {
-        rmax = r;
-        ifaceCut = iface;
-      }
+#define COST_REFLEX 4.0
+#define COST_SPLIT 1.0
+#define COST_BALANCE 1.0
+
+// fewest point classifications worth a task of their own when scoring candidates
+#define SCORE_TASK_POINTS 65536
+
+class CutScoring
+{
+  public:
+  GeoSolid *solid;
+  vector<CutCandidate> *candidates;
+  GeoPointArray points;
+  vector<int> offsets, counts; // where the points of each face are in points
+  vector<int> best; // best candidate of each range
+};
+
+/*
+Scores a candidate cut plane by the reflex edges it resolves, less the faces it would split and how unevenly it
+would divide the remaining faces
+*/
+
+static void ScoreCutCandidate(CutScoring &scoring, CutCandidate &c, signed char *sides)
+{
+  list<GeoFace>::iterator iface;
+  int i;
+
+  GeoClassifyPoints(scoring.points,c.face->plane(),sides);
+  c.split = c.front = c.back = 0;
+
+  for (iface = scoring.solid->faces.begin(), i = 0; iface != scoring.solid->faces.end(); iface++, i++)
+  {
+    if (IsInPlane(*iface,&sides[scoring.offsets[i]]))
+      continue;
+
+    switch (SideOfPlane(&sides[scoring.offsets[i]],scoring.counts[i]))
+    {
+      case SIDE_FRONT: c.front++; break;
+      case SIDE_BACK: c.back++; break;
+      default: c.split++; break;
+    }
+  }
+
+  c.score = COST_REFLEX * c.reflex - COST_SPLIT * c.split -
+    COST_BALANCE * abs(c.front - c.back) / double(c.front + c.back + c.split);
+
+  GeoDebugPrintf("    Candidate face %i: %i reflex edges, %i faces split, %i front, %i back, score %lg\n",
+    c.face->index,c.reflex,c.split,c.front,c.back,c.score);
+}
+
+// scores one range of the candidates, keeping the first of the best in it
+static void RunCutScoring(int task, void *data)
+{
+  CutScoring *scoring = (CutScoring *)data;
+  vector<CutCandidate> &candidates = *scoring->candidates;
+  vector<signed char> sides;
+  int i, first, last, n, nranges;
+
+  n = candidates.size();
+  nranges = scoring->best.size();
+  first = int((long long) n * task / nranges);
+  last = int((long long) n * (task + 1) / nranges);
+
+  sides.resize(scoring->points.size());
+  scoring->best[task] = first;
+
+  for (i = first; i < last; i++)
+  {
+    ScoreCutCandidate(*scoring,candidates[i],&sides[0]);
+
+    if (candidates[i].score > candidates[scoring->best[task]].score)
+      scoring->best[task] = i;
+  }
+}
+
+/*
+Scores each candidate cut plane, returning the index of the best, the first one on ties. Each candidate only reads
+the solid, so with threads ranges of them are scored as tasks and their bests compared in order, which picks the
+same one as scoring them in turn
+*/
+
+static int ScoreCutCandidates(GeoSolid &solid, vector<CutCandidate> *candidates)
+{
+  list<GeoFace>::iterator iface;
+  CutScoring scoring;
+  double work;
+  int i, nranges, best;
+
+  scoring.solid = &solid;
+  scoring.candidates = candidates;
+
+  foreach (iface, solid.faces)
+  {
+    scoring.offsets.push_back(scoring.points.size());
+    scoring.counts.push_back(GatherFacePoints(*iface,&scoring.points));
+  }
+
+  work = double(scoring.points.size()) * candidates->size();
+  nranges = int(work / SCORE_TASK_POINTS);
+
+  if (nranges > GeoCurContext->threads)
+    nranges = GeoCurContext->threads;
+
+  if (nranges > int(candidates->size()))
+    nranges = candidates->size();
+
+  if (nranges < 1)
+    nranges = 1;
+
+  scoring.best.resize(nranges);
+  GeoParallelFor(nranges,RunCutScoring,&scoring);
+
+  best = scoring.best[0];
+
+  for (i = 1; i < nranges; i++)
+    if ((*candidates)[scoring.best[i]].score > (*candidates)[best].score)
+      best = scoring.best[i];
+
+  return best;
+}
+
+// returns the face whose plane has the best score, the first one on ties
+list<GeoFace>::iterator SelectCutPlaneCost(GeoSolid &solid, map<GeoPlane,int,typeof(PlaneIsLessThan)*> &reflexEdges)
+{
+  map<GeoPlane,int,typeof(PlaneIsLessThan)*> index(PlaneIsLessThan);
+  vector<CutCandidate> candidates;
+  list<GeoFace>::iterator iface;
+  CutCandidate c;
+  GeoPlane plane;
+  clock_t t;
+  int best;
+
+  t = clock();
+
+  foreach (iface, solid.faces)
+  {
+    plane = iface->plane();
+
+    if (reflexEdges[plane] == 0 || index.find(plane) != index.end())
+      continue;
+
+    index[plane] = candidates.size();
+    c.face = iface;
+    c.reflex = reflexEdges[plane];
+    candidates.push_back(c);
+  }
+
+  GeoCurContext->decompose.ncandidates += candidates.size();
+  best = ScoreCutCandidates(solid,&candidates);
+  GeoCurContext->decompose.selectTime += clock() - t;
+
+  return candidates[best].face;
+}
+
+// returns 1 if the solid is proven convex, skipping the reflex edge search
+static int PrefilterSolid(GeoSolid &solid)
+{
+  clock_t t;
+  int convex;
+
+  t = clock();
+  convex = IsConvexSolid(solid);
+  GeoCurContext->decompose.prefilterTime += clock() - t;
+  GeoCurContext->decompose.nsolids++;
+
+  if (convex)
+  {
+    GeoDebugPrintf("Solid %i is convex, skipping reflex edge search\n",solid.index);
+
+    GeoCurContext->decompose.nconvex++;
+    GeoCurContext->decompose.nfacesSkipped += solid.faces.size();
+  }
+
+  return convex;
+}
+
+// finds the face whose plane the solid is cut along, returning its number of reflex edges or 0 if there are none
+static int FindCutFace(GeoSolid &solid, list<GeoFace>::iterator *ifaceCut)
+{
+  list<GeoFace>::iterator iface;
+  map<GeoPlane,int,typeof(PlaneIsLessThan)*> reflexEdges(PlaneIsLessThan);
+  GeoPlane plane;
+  clock_t t;
+  int r, rmax;
+
+  GeoDebugPrintf("Decomposing Solid:\n  Finding reflex edges:\n");
+
+  rmax = 0;
+  t = clock();
+
+  for (iface = solid.faces.begin(); iface != solid.faces.end(); iface++)
+  {
+    GeoDebugPrintf("\n    Testing reflex edges for face %i [%s]\n",iface->index, iface->tex.texture);
+
+    plane = iface->plane();
+
+    if (iface->reflex < 0)
+    {
+      iface->reflex = ReflexEdges(solid,iface);
+      GeoCurContext->decompose.nfacesTested++;
+    }
+    else
+    {
+      GeoDebugPrintf("    Face is unchanged since last cut, %i reflex edges\n",iface->reflex);
+      GeoCurContext->decompose.nfacesCached++;
     }
 
-    if (rmax != 0)
+    r = iface->reflex;
+
+    if (reflexEdges.find(plane) == reflexEdges.end())
+      reflexEdges[plane] = r;
+    else
+      r = (reflexEdges[plane] += r);
+
+    GeoDebugPrintf("    Plane [%lg %lg %lg %lg] now has %i reflex edges\n",plane.norm.x,plane.norm.y,plane.norm.z,plane.d,r);
+
+    if (r > rmax)
     {
-      GeoDebugPrintf("\n  Cutting along face %i [%s] with %i reflex edges:\n",ifaceCut->index,ifaceCut->tex.texture,rmax);
+      rmax = r;
+      *ifaceCut = iface;
+    }
+  }
+
+  GeoCurContext->decompose.reflexTime += clock() - t;
 
-      if (nsolids > 0)
+  if (rmax != 0 && GeoCurContext->decomposeMode == DECOMPOSE_COST)
+  {
+    *ifaceCut = SelectCutPlaneCost(solid,reflexEdges);
+    rmax = reflexEdges[(*ifaceCut)->plane()];
+  }
+
+  if (rmax != 0)
+    GeoDebugPrintf("\n  Cutting along face %i [%s] with %i reflex edges:\n",(*ifaceCut)->index,(*ifaceCut)->tex.texture,rmax);
+
+  return rmax;
+}
+
+/*
+The first ntested solids are already known not to be convex. The pieces of a cut take the place of the solid and
+are decomposed before the solids after it, which leaves them in the same order as DecomposeForked() does
+*/
+
+static void DecomposeWorklist(list<GeoSolid> *solids, int ntested)
+{
+  list<GeoSolid>::iterator isolid, inext, ipiece;
+  list<GeoFace>::iterator ifaceCut;
+  list<GeoSolid> pieces;
+  int tested, cut;
+
+  for (isolid = solids->begin(); isolid != solids->end(); --ntested)
+  {
+    GeoCurContext->brush = isolid->index;
+
+    inext = isolid;
+    ++inext;
+    tested = ntested > 0;
+    cut = 0;
+
+    while (isolid != inext)
+    {
+      if ((!tested && PrefilterSolid(*isolid)) || FindCutFace(*isolid,&ifaceCut) == 0)
+      {
+        ++isolid;
+        tested = 0;
+        continue;
+      }
+
+      if (!cut)
         GeoPrintMessage("Decomposing non-convex solid");
 
-      CutSolid(*isolid,ifaceCut->plane(),solids);
+      pieces.clear();
+      CutSolid(*isolid,ifaceCut->plane(),&pieces);
+
+      ipiece = isolid;
+      ++ipiece;
+      solids->splice(ipiece,pieces);
       solids->erase(isolid++);
+      tested = 0;
+      cut = 1;
     }
+  }
+}
+
+/*
+With threads, the pieces of each cut are decomposed as tasks of their own rather than added to a worklist, so
+that a single solid needing many cuts is spread across the threads. Pieces are put back in the order they were
+cut, so the result doesn't depend on which thread decomposed them
+*/
+
+class DecomposeFork
+{
+  public:
+  vector<list<GeoSolid> > pieces;
+  vector<GeoException *> errors;
+  int depth;
+};
+
+static void DecomposeForked(list<GeoSolid> *solids, int tested, int depth);
+
+static void RunDecomposeFork(int i, void *data)
+{
+  DecomposeFork *fork = (DecomposeFork *)data;
+
+  try
+  {
+    DecomposeForked(&fork->pieces[i],0,fork->depth);
+  }
+
+  catch (GeoException *ex)
+  {
+    fork->errors[i] = ex;
+  }
+}
+
+// decomposes the single solid in solids, which is known not to be convex if tested is set
+static void DecomposeForked(list<GeoSolid> *solids, int tested, int depth)
+{
+  list<GeoFace>::iterator ifaceCut;
+  list<GeoSolid> pieces;
+  DecomposeFork fork;
+  GeoException *error = NULL;
+  int i;
+
+  if (!tested && PrefilterSolid(solids->front()))
+    return;
+
+  if (FindCutFace(solids->front(),&ifaceCut) == 0)
+    return;
+
+  if (depth == 0)
+    GeoPrintMessage("Decomposing non-convex solid");
+
+  CutSolid(solids->front(),ifaceCut->plane(),&pieces);
+  solids->clear();
+
+  while (!pieces.empty())
+  {
+    fork.pieces.push_back(list<GeoSolid>());
+    fork.pieces.back().splice(fork.pieces.back().end(),pieces,pieces.begin());
+  }
+
+  fork.errors.resize(fork.pieces.size(),NULL);
+  fork.depth = depth + 1;
+
+  GeoParallelFor(fork.pieces.size(),RunDecomposeFork,&fork);
+
+  for (i = 0; i < int(fork.pieces.size()); i++)
+  {
+    solids->splice(solids->end(),fork.pieces[i]);
+
+    if (error == NULL)
+      error = fork.errors[i];
     else
+      delete fork.errors[i];
+  }
+
+  if (error != NULL)
+    throw error;
+}
+
+/*
+Identical solids at different positions decompose into the same pieces, so when flagDecomposeMemo is set the pieces of
+each non-convex solid are cached under a key built from its faces relative to its lowest vertex. Texture shifts
+depend on position and are left out of the key. Instead each piece face records which face of the solid it came
+from, and is given that face's texture when replayed. Faces made by cuts are independent of position and are
+replayed as they are.
+*/
+
+class DecomposeMemoEntry
+{
+  public:
+  list<GeoSolid> pieces; // relative to the lowest vertex of the solid
+  vector<vector<int> > sources; // for each face of each piece, the index of its face in key order, or -1
+  clock_t time;
+};
+
+class DecomposeMemoStats
+{
+  public:
+  int nhits, nmisses;
+  clock_t keyTime, missTime;
+
+  DecomposeMemoStats() : nhits(0), nmisses(0), keyTime(0), missTime(0) {}
+};
+
+// state carried from DecomposeMemoReplay() to DecomposeMemoStore() for a solid not found in the memo cache
+class DecomposeMemoState
+{
+  public:
+  string key;
+  GeoVector ref;
+  vector<GeoFace *> faces;
+  clock_t start;
+  int valid;
+};
+
+// the memo cache of a conversion, shared by all of its threads
+class DecomposeMemoCache
+{
+  public:
+  map<string, DecomposeMemoEntry> entries;
+  DecomposeMemoStats stats;
+  mutex lock;
+};
+
+void StartDecomposeMemo(void)
+{
+  if (GeoCurContext->flagDecomposeMemo && !GeoCurContext->memo)
+    GeoCurContext->memo = make_shared<DecomposeMemoCache>();
+}
+
+static inline int VectorIsLessThan(const GeoVector &a, const GeoVector &b)
+{
+  return a.x < b.x || (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z)));
+}
+
+static void TranslateSolid(GeoSolid *solid, const GeoVector &t)
+{
+  list<GeoFace>::iterator iface;
+  list<list<GeoEdge> >::iterator ile;
+  list<GeoEdge>::iterator ie;
+
+  foreach (iface, solid->faces)
+  {
+    foreach (ie, iface->edges)
+    {
+      ie->v1 = ie->v1 + t;
+      ie->v2 = ie->v2 + t;
+    }
+
+    foreach (ile, iface->inedges)
+      foreach (ie, *ile)
+      {
+        ie->v1 = ie->v1 + t;
+        ie->v2 = ie->v2 + t;
+      }
+  }
+}
+
+/*
+Builds the memo key of a solid, storing its lowest vertex in ref and its faces in key order in faces.
+Returns 0 if the solid can't be memoised
+*/
+
+static int DecomposeMemoKey(GeoSolid &solid, string *key, GeoVector *ref, vector<GeoFace *> *faces)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  vector<pair<string, GeoFace *> > keys;
+  vector<GeoVector> verts;
+  GeoVector v;
+  string s;
+  int i, first;
+
+  *ref = solid.faces.front().edges.front().v1;
+
+  foreach (iface, solid.faces)
+  {
+    if (!iface->inedges.empty())
+      return 0;
+
+    foreach (ie, iface->edges)
+      if (VectorIsLessThan(ie->v1,*ref))
+        *ref = ie->v1;
+  }
+
+  foreach (iface, solid.faces)
+  {
+    verts.clear();
+
+    foreach (ie, iface->edges)
+      verts.push_back(ie->v1 - *ref);
+
+    first = 0;
+
+    for (i = 1; i < int(verts.size()); i++)
+      if (VectorIsLessThan(verts[i],verts[first]))
+        first = i;
+
+    s.assign(iface->tex.texture);
+    s.push_back('\0');
+    s.append((const char *)&iface->tex.uaxis,sizeof(GeoVector));
+    s.append((const char *)&iface->tex.vaxis,sizeof(GeoVector));
+    s.append((const char *)&iface->tex.uscale,sizeof(float));
+    s.append((const char *)&iface->tex.vscale,sizeof(float));
+    s.append((const char *)&iface->tex.rot,sizeof(float));
+
+    for (i = 0; i < int(verts.size()); i++)
+      s.append((const char *)&verts[(first + i) % verts.size()],sizeof(GeoVector));
+
+    keys.push_back(make_pair(s,&*iface));
+  }
+
+  sort(keys.begin(),keys.end());
+
+  key->clear();
+  faces->clear();
+
+  for (i = 0; i < int(keys.size()); i++)
+  {
+    key->append(keys[i].first);
+    key->push_back('\n');
+    faces->push_back(keys[i].second);
+  }
+
+  return 1;
+}
+
+// appends the pieces of entry to pieces, moved to the position of solid and given its textures
+static void ReplayMemoEntry(const DecomposeMemoEntry &entry, GeoSolid &solid, DecomposeMemoState *memo, list<GeoSolid> *pieces)
+{
+  list<GeoSolid>::const_iterator ipiece;
+  list<GeoFace>::iterator iface;
+  int i, j;
+
+  GeoDebugPrintf("Replaying %i cached pieces of solid %i\n",int(entry.pieces.size()),solid.index);
+
+  for (ipiece = entry.pieces.begin(), i = 0; ipiece != entry.pieces.end(); ++ipiece, i++)
+  {
+    pieces->push_back(*ipiece);
+
+    GeoSolid &piece = pieces->back();
+    TranslateSolid(&piece,memo->ref);
+
+    for (iface = piece.faces.begin(), j = 0; iface != piece.faces.end(); ++iface, j++)
+      if (entry.sources[i][j] >= 0)
+        iface->tex = memo->faces[entry.sources[i][j]]->tex;
+
+    piece.color = solid.color;
+    piece.visgroup = solid.visgroup;
+    piece.index = solid.index;
+  }
+}
+
+/*
+Appends the cached pieces of solid to pieces and returns 1, or returns 0 if it isn't cached, in which case
+the key is left in memo for DecomposeMemoStore()
+*/
+
+static int DecomposeMemoReplay(GeoSolid &solid, list<GeoSolid> *pieces, DecomposeMemoState *memo)
+{
+  DecomposeMemoCache *cache = GeoCurContext->memo.get();
+  map<string, DecomposeMemoEntry>::iterator ientry;
+  clock_t t;
+
+  t = clock();
+  memo->valid = DecomposeMemoKey(solid,&memo->key,&memo->ref,&memo->faces);
+  t = clock() - t;
+  memo->start = clock();
+
+  lock_guard<mutex> guard(cache->lock);
+
+  cache->stats.keyTime += t;
+
+  if (!memo->valid || (ientry = cache->entries.find(memo->key)) == cache->entries.end())
+    return 0;
+
+  ReplayMemoEntry(ientry->second,solid,memo,pieces);
+  cache->stats.nhits++;
+
+  return 1;
+}
+
+// caches the pieces a solid missed by DecomposeMemoReplay() was decomposed into, which are at ref relative to it
+static void DecomposeMemoStore(const list<GeoSolid> &pieces, const GeoVector &ref, DecomposeMemoState *memo)
+{
+  DecomposeMemoCache *cache = GeoCurContext->memo.get();
+  list<GeoSolid>::const_iterator ipiece;
+  list<GeoFace>::iterator iface;
+  DecomposeMemoEntry entry;
+  GeoPlane plane;
+  clock_t t;
+  int i;
+
+  t = clock() - memo->start;
+
+  if (memo->valid)
+  {
+    foreach (ipiece, pieces)
+    {
+      entry.pieces.push_back(*ipiece);
+      entry.sources.push_back(vector<int>());
+
+      GeoSolid &piece = entry.pieces.back();
+      TranslateSolid(&piece,-ref);
+
+      foreach (iface, piece.faces)
+      {
+        plane = iface->plane();
+
+        for (i = 0; i < int(memo->faces.size()); i++)
+          if (memo->faces[i]->tex == iface->tex && memo->faces[i]->plane().norm == plane.norm &&
+              fequal(memo->faces[i]->plane().d + memo->ref * plane.norm,plane.d))
+            break;
+
+        entry.sources.back().push_back(i < int(memo->faces.size()) ? i : -1);
+      }
+    }
+  }
+
+  lock_guard<mutex> guard(cache->lock);
+
+  cache->stats.nmisses++;
+  cache->stats.missTime += t;
+
+  if (memo->valid)
+    cache->entries[memo->key] = entry;
+}
+
+// copies solid with its faces in key order, each starting at its lowest vertex, relative to the lowest vertex of the solid
+static void CanonicalSolid(GeoSolid &solid, DecomposeMemoState *memo, GeoSolid *canonical)
+{
+  list<GeoEdge>::iterator ie, ifirst;
+  int i;
+
+  canonical->color = solid.color;
+  canonical->visgroup = solid.visgroup;
+  canonical->index = solid.index;
+  canonical->faces.clear();
+
+  for (i = 0; i < int(memo->faces.size()); i++)
+  {
+    canonical->faces.push_back(*memo->faces[i]);
+
+    GeoFace &face = canonical->faces.back();
+    face.n = GeoVector(0,0,0);
+    face.index = i;
+    face.reflex = -1;
+
+    ifirst = face.edges.begin();
+
+    foreach (ie, face.edges)
+      if (VectorIsLessThan(ie->v1,ifirst->v1))
+        ifirst = ie;
+
+    face.edges.splice(face.edges.end(),face.edges,face.edges.begin(),ifirst);
+  }
+
+  TranslateSolid(canonical,-memo->ref);
+}
+
+/*
+Decomposes solid into pieces with decompose(), or replays the pieces of an identical solid already decomposed.
+Returns 1 if the pieces were replayed
+*/
+
+int DecomposeMemoSolid(GeoSolid &solid, list<GeoSolid> *pieces, void (*decompose)(GeoSolid &solid, list<GeoSolid> *pieces))
+{
+  map<string, DecomposeMemoEntry>::iterator ientry;
+  DecomposeMemoState memo;
+  list<GeoSolid> canonicalPieces;
+  GeoSolid canonical;
+
+  if (DecomposeMemoReplay(solid,pieces,&memo))
+    return 1;
+
+  if (!memo.valid)
+  {
+    decompose(solid,pieces);
+    DecomposeMemoStore(*pieces,memo.ref,&memo);
+    return 0;
+  }
+
+  /*
+  With several threads, which of a set of identical solids gets decomposed depends on timing. So the solid is
+  decomposed in the form its key describes, which is the same for all of them, and its pieces are replayed. This
+  is done without threads too, so that the output doesn't depend on their number
+  */
+
+  CanonicalSolid(solid,&memo,&canonical);
+  decompose(canonical,&canonicalPieces);
+  DecomposeMemoStore(canonicalPieces,GeoVector(0,0,0),&memo);
+
+  DecomposeMemoCache *cache = GeoCurContext->memo.get();
+  lock_guard<mutex> guard(cache->lock);
+
+  ientry = cache->entries.find(memo.key);
+  ReplayMemoEntry(ientry->second,solid,&memo,pieces);
+
+  return 0;
+}
+
+void PrintDecomposeMemoStats(void)
+{
+  DecomposeMemoStats stats;
+  double misstime, saved;
+
+  if (GeoCurContext->memo)
+    stats = GeoCurContext->memo->stats;
+
+  misstime = stats.nmisses > 0 ? double(stats.missTime) / stats.nmisses : 0;
+  saved = misstime * stats.nhits - stats.keyTime;
+
+  GeoPrintf("  %i of %i non-convex solids replayed from the memo cache, estimated time saved %.3lfs\n",
+    stats.nhits, stats.nhits + stats.nmisses, saved / CLOCKS_PER_SEC);
+}
+
+void DecomposeSolid(GeoSolid &solid, list<GeoSolid> *pieces)
+{
+  pieces->push_back(solid);
+
+  if (GeoCurContext->threads > 0)
+    DecomposeForked(pieces,1,0);
+  else
+    DecomposeWorklist(pieces,1);
+}
+
+// decomposes each non-convex solid on its own so that its pieces can be cached
+static void DecomposeSolidsMemo(list<GeoSolid> *solids)
+{
+  list<GeoSolid>::iterator isolid;
+  list<GeoSolid> pieces;
+
+  for (isolid = solids->begin(); isolid != solids->end();)
+  {
+    GeoCurContext->brush = isolid->index;
+
+    if (PrefilterSolid(*isolid))
+    {
       ++isolid;
+      continue;
+    }
 
-    --nsolids;
+    pieces.clear();
+
+    if (DecomposeMemoSolid(*isolid,&pieces,DecomposeSolid))
+      GeoPrintMessage("Decomposing non-convex solid");
+
+    solids->splice(isolid,pieces);
+    solids->erase(isolid++);
   }
 }
 
+static void DecomposeSolidsForked(list<GeoSolid> *solids)
+{
+  list<GeoSolid>::iterator isolid;
+  list<GeoSolid> pieces;
+
+  for (isolid = solids->begin(); isolid != solids->end();)
+  {
+    GeoCurContext->brush = isolid->index;
+
+    pieces.clear();
+    pieces.splice(pieces.end(),*solids,isolid++);
+    DecomposeForked(&pieces,0,0);
+    solids->splice(isolid,pieces);
+  }
+}
+
+void DecomposeSolids(list<GeoSolid> *solids)
+{
+  GeoCurContext->decompose.nsolidsIn += solids->size();
+
+  if (GeoCurContext->flagDecomposeMemo)
+    DecomposeSolidsMemo(solids);
+  else if (GeoCurContext->threads > 0)
+    DecomposeSolidsForked(solids);
+  else
+    DecomposeWorklist(solids,0);
+
+  GeoCurContext->decompose.nsolidsOut += solids->size();
+}
+
+void PrintDecomposeStats(void)
+{
+  DecomposeStats &stats = GeoCurContext->decompose;
+  double facetime, saved;
+
+  facetime = stats.nfacesTested > 0 ? double(stats.reflexTime) / stats.nfacesTested : 0;
+  saved = facetime * stats.nfacesSkipped - stats.prefilterTime;
+
+  GeoPrintf("  %i of %i solids proven convex by prefilter (%i faces skipped reflex edge search)\n",
+    stats.nconvex, stats.nsolids, stats.nfacesSkipped);
+  GeoPrintf("  %i faces searched for reflex edges, %i reused counts carried through cuts\n",
+    stats.nfacesTested, stats.nfacesCached);
+  GeoPrintf("  Prefilter time %.3lfs, reflex edge search time %.3lfs, estimated time saved %.3lfs\n",
+    double(stats.prefilterTime) / CLOCKS_PER_SEC, double(stats.reflexTime) / CLOCKS_PER_SEC, saved / CLOCKS_PER_SEC);
+
+  GeoPrintf("  %i cuts turned %i solids into %i\n",
+    stats.ncuts, stats.nsolidsIn, stats.nsolidsOut);
+
+  if (GeoCurContext->decomposeMode == DECOMPOSE_COST)
+    GeoPrintf("  %i candidate cut planes scored in %.3lfs\n",
+      stats.ncandidates, double(stats.selectTime) / CLOCKS_PER_SEC);
+
+  if (GeoCurContext->flagDecomposeMemo)
+    PrintDecomposeMemoStats();
+}
+
 void DecomposeGroup(GeoGroup *group)
 {
   list<GeoEntity>::iterator ientity;
   list<GeoGroup>::iterator igroup;
 
-  GeoCurEntity = 0;
+  StartDecomposeMemo();
+
+  if (GeoCurContext->threads > 0)
+  {
+    ParallelSolidPass(group,DecomposeSolids);
+    return;
+  }
+
+  GeoCurContext->entity = 0;
   DecomposeSolids(&group->solids);
 
   foreach (ientity, group->entities)
   {
-    GeoCurEntity = ientity->index;
+    GeoCurContext->entity = ientity->index;
     DecomposeSolids(&ientity->solids);
   }
 
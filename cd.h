@@ -15,11 +15,31 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <ctime>
+#include <string>
+#include <vector>
 #include "geo.h"
 
 using namespace std;
 
+// ways of choosing the plane DecomposeSolids() cuts along
+enum
+{
+  DECOMPOSE_REFLEX, // plane with the most reflex edges
+  DECOMPOSE_COST // plane with the best balance of reflex edges resolved, faces split and piece sizes
+};
+
 void DecomposeGroup(GeoGroup *group);
+void DecomposeSolids(list<GeoSolid> *solids);
+// cuts a solid known not to be convex into convex pieces, which are appended to pieces
+void DecomposeSolid(GeoSolid &solid, list<GeoSolid> *pieces);
+int ReflexEdges(GeoSolid &solid, list<GeoFace>::iterator iface);
+int IsConvexSolid(GeoSolid &solid);
+void PrintDecomposeStats(void);
+// creates the memo cache of the current context if its flagDecomposeMemo is set, before its tasks start sharing it
+void StartDecomposeMemo(void);
+int DecomposeMemoSolid(GeoSolid &solid, list<GeoSolid> *pieces, void (*decompose)(GeoSolid &solid, list<GeoSolid> *pieces));
+void PrintDecomposeMemoStats(void);
 void GenerateFaces(list<GeoEdge> *edges, GeoVector norm, list<GeoFace> *faces, const GeoTexture &tex);
 
 #endif
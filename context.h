@@ -0,0 +1,108 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_CONTEXT
+#define _INC_CONTEXT
+
+#include <cassert>
+#include <ctime>
+#include <memory>
+#include <string>
+#include "pred.h"
+
+using namespace std;
+
+class DecomposeStats
+{
+  public:
+  int nsolids, nconvex, nfacesTested, nfacesCached, nfacesSkipped, ncuts, nsolidsIn, nsolidsOut, ncandidates;
+  clock_t prefilterTime, reflexTime, selectTime;
+
+  DecomposeStats() : nsolids(0), nconvex(0), nfacesTested(0), nfacesCached(0), nfacesSkipped(0), ncuts(0),
+    nsolidsIn(0), nsolidsOut(0), ncandidates(0), prefilterTime(0), reflexTime(0), selectTime(0) {}
+
+  DecomposeStats &operator+=(const DecomposeStats &s)
+  {
+    nsolids += s.nsolids;
+    nconvex += s.nconvex;
+    nfacesTested += s.nfacesTested;
+    nfacesCached += s.nfacesCached;
+    nfacesSkipped += s.nfacesSkipped;
+    ncuts += s.ncuts;
+    nsolidsIn += s.nsolidsIn;
+    nsolidsOut += s.nsolidsOut;
+    ncandidates += s.ncandidates;
+    prefilterTime += s.prefilterTime;
+    reflexTime += s.reflexTime;
+    selectTime += s.selectTime;
+    return *this;
+  }
+};
+
+class DecomposeMemoCache;
+
+/*
+Everything a conversion reads or updates besides the map itself. Each thread works in the context GeoCurContext
+points to, so conversions with contexts of their own can run at the same time. The tasks GeoParallelFor() runs get
+a copy of the context of the thread that queued them, with counters of their own which are added back to it when
+they finish, and the location and messages of each task are kept apart the same way
+*/
+
+class GeoContext
+{
+  public:
+  double epsilon;
+  double gridSize; // 0 unless vertices are snapped to a grid
+  int flagDebug, flagStats, flagQuiet, flagRMFDebug;
+  int decomposeMode; // DECOMPOSE_REFLEX or DECOMPOSE_COST
+  int flagDecomposeMemo;
+  int threads; // number of threads per-solid passes run on, or 0 to run them serially in the traditional order
+
+  // location reported by messages and exceptions
+  int entity, brush;
+
+  // when set, messages are appended to the string, otherwise they are passed to output if it is set or printed
+  string *messages;
+  void (*output)(const char *str, void *data);
+  void *outputData;
+
+  DecomposeStats decompose;
+  GeoPredicateStats predicates;
+
+  // pieces of the non-convex solids decomposed so far, shared by the tasks of the conversion
+  shared_ptr<DecomposeMemoCache> memo;
+
+  GeoContext() : epsilon(0.004), gridSize(0), flagDebug(0), flagStats(0), flagQuiet(0), flagRMFDebug(0),
+    decomposeMode(0), flagDecomposeMemo(0), threads(0), entity(0), brush(0), messages(NULL),
+    output(NULL), outputData(NULL) {}
+};
+
+/*
+The context of this thread, which is a default one shared by every thread that hasn't set its own. Code reads and
+writes the fields of the conversion it is working on through it, as in GeoCurContext->epsilon, so code run on a
+thread of its own must make the context of its conversion current first, as GeoParallelFor() does for its tasks.
+It is read by every epsilon comparison, so it is declared __thread rather than thread_local, which would make each
+read check whether it needs initialising
+*/
+
+extern __thread GeoContext *GeoCurContext;
+
+// makes context the current one of this thread until the end of the scope
+class GeoContextScope
+{
+  public:
+  GeoContext *saved;
+
+  GeoContextScope(GeoContext *context) : saved(GeoCurContext) { assert(context != NULL); GeoCurContext = context; }
+  ~GeoContextScope() { GeoCurContext = saved; }
+};
+
+#endif
@@ -10,39 +10,88 @@
 
 #include <list>
 #include <map>
+#include <set>
+#include <string>
 #include <cmath>
+#include <vector>
+#include <algorithm>
 #include "geo.h"
 #include "cd.h"
+#include "pool.h"
 
-int FlagGeoDebug;
-double GeoEpsilon;
+static GeoContext GeoDefaultContext;
+__thread GeoContext *GeoCurContext = &GeoDefaultContext;
+
+void GeoPrintString(const char *str)
+{
+  if (GeoCurContext->messages != NULL)
+    GeoCurContext->messages->append(str);
+  else if (GeoCurContext->output != NULL)
+    GeoCurContext->output(str,GeoCurContext->outputData);
+  else
+    fputs(str,stdout);
+}
+
+// prints the message, or passes it to GeoPrintString() if the current context has somewhere else to put it
+static void GeoOutput(const char *str, va_list args)
+{
+  char buf[1024];
+
+  if (GeoCurContext->messages == NULL && GeoCurContext->output == NULL)
+  {
+    vprintf(str,args);
+    return;
+  }
+
+  vsnprintf(buf,sizeof(buf),str,args);
+  GeoPrintString(buf);
+}
+
+static void GeoOutput(const char *str, ...)
+{
+  va_list args;
+
+  va_start(args,str);
+  GeoOutput(str,args);
+  va_end(args);
+}
+
+void GeoPrintf(const char *str, ...)
+{
+  va_list args;
+
+  va_start(args,str);
+  GeoOutput(str,args);
+  va_end(args);
+}
 
 void GeoDebugPrintf(const char *str,...)
 {
-  if (!FlagGeoDebug)
+  if (!GeoCurContext->flagDebug)
     return;
 
   va_list args;
 
   va_start(args,str);
-  vprintf(str,args);
+  GeoOutput(str,args);
   va_end(args);
   fflush(stdout);
 }
 
-int GeoCurEntity, GeoCurBrush;
-
 void GeoPrintMessage(const char *str, ...)
 {
   va_list args;
 
-  printf("  (Entity %i, Brush %i): ", GeoCurEntity, GeoCurBrush);
+  if (GeoCurContext->flagQuiet)
+    return;
+
+  GeoOutput("  (Entity %i, Brush %i): ", GeoCurContext->entity, GeoCurContext->brush);
 
   va_start(args,str);
-  vprintf(str,args);
+  GeoOutput(str,args);
   va_end(args);
 
-  printf("\n");
+  GeoOutput("\n");
   fflush(stdout);
 }
 
@@ -50,48 +99,171 @@ void GeoPrintWarning(const char *str, ...)
 {
   va_list args;
 
-  printf("  WARNING (Entity %i, Brush %i): ", GeoCurEntity, GeoCurBrush);
+  GeoOutput("  WARNING (Entity %i, Brush %i): ", GeoCurContext->entity, GeoCurContext->brush);
 
   va_start(args,str);
-  vprintf(str,args);
+  GeoOutput(str,args);
   va_end(args);
 
-  printf("\n");
+  GeoOutput("\n");
   fflush(stdout);
 }
 
-int GeoVector::isIn(const list<GeoEdge> &edges, const GeoVector &norm) const
+GeoPolygon2D::GeoPolygon2D(const list<GeoEdge> &edges, const GeoVector &norm)
 {
-  int wind, side1, side2;
   list<GeoEdge>::const_iterator ie;
-  GeoPlane
-    plane1(norm % edges.front().vec(),*this),
-    plane2(norm % plane1.norm, *this);
+  double pu, pv;
+
+  if (fabs(norm.x) >= fabs(norm.y) && fabs(norm.x) >= fabs(norm.z))
+    axis = 0;
+  else if (fabs(norm.y) >= fabs(norm.z))
+    axis = 1;
+  else
+    axis = 2;
+
+  umin = vmin = DBL_MAX;
+  umax = vmax = -DBL_MAX;
 
-  foreach (ie,edges)
+  u.reserve(edges.size()+1);
+  v.reserve(edges.size()+1);
+
+  foreach (ie, edges)
   {
-    side1 = ie->v1.sideOf(plane1);
-    side2 = ie->v2.sideOf(plane1);
+    project(ie->v1,&pu,&pv);
+    u.push_back(pu);
+    v.push_back(pv);
+
+    if (pu < umin) umin = pu;
+    if (pu > umax) umax = pu;
+    if (pv < vmin) vmin = pv;
+    if (pv > vmax) vmax = pv;
+  }
+
+  u.push_back(u.front());
+  v.push_back(v.front());
+}
+
+// tests whether (pu,pv) is within epsilon of any edge
+int GeoPolygon2D::isOn(double pu, double pv) const
+{
+  double du, dv, wu, wv, l, t;
+  int i, n = u.size() - 1;
 
-    if (side1 != side2 && ie->intersect(plane1).sideOf(plane2) == 1)
-      if (side1 > side2)
-        wind++;
-      else
-        wind--;
+  for (i = 0; i < n; i++)
+  {
+    du = u[i+1] - u[i];
+    dv = v[i+1] - v[i];
+    wu = pu - u[i];
+    wv = pv - v[i];
+    l = du*du + dv*dv;
+    t = l > 0 ? (wu*du + wv*dv) / l : 0;
+
+    if (t < 0)
+      t = 0;
+    else if (t > 1)
+      t = 1;
+
+    wu -= du*t;
+    wv -= dv*t;
+
+    if (wu*wu + wv*wv <= GeoCurContext->epsilon*GeoCurContext->epsilon)
+      return 1;
   }
 
-  return wind != 0;
+  return 0;
 }
 
-int GeoVector::isIn(const GeoFace &face) const
+// non-zero winding number test
+int GeoPolygon2D::isIn(double pu, double pv) const
+{
+  double eps = GeoCurContext->epsilon;
+  int i, side, wind = 0, n = u.size() - 1;
+
+  if (pu < umin - eps || pu > umax + eps || pv < vmin - eps || pv > vmax + eps)
+    return 0;
+
+  for (i = 0; i < n; i++)
+  {
+    side = GeoOrient2D(u[i],v[i],u[i+1],v[i+1],pu,pv);
+
+    if (v[i] <= pv)
+    {
+      if (v[i+1] > pv && side > 0)
+        ++wind;
+    }
+    else
+    {
+      if (v[i+1] <= pv && side < 0)
+        --wind;
+    }
+  }
+
+  return wind != 0 && !isOn(pu,pv);
+}
+
+void GeoPolygon2D::isIn(const vector<GeoVector> &points, vector<char> *inside) const
+{
+  double pu, pv;
+  int i;
+
+  inside->resize(points.size());
+
+  for (i = 0; i < int(points.size()); i++)
+  {
+    project(points[i],&pu,&pv);
+    (*inside)[i] = isIn(pu,pv);
+  }
+}
+
+GeoFacePolygon::GeoFacePolygon(const GeoFace &face) : outer(face.edges,face.norm())
 {
   list<list<GeoEdge> >::const_iterator ile;
 
   foreach (ile, face.inedges)
-    if (isIn(*ile,face.norm()) || isOn(*ile))
+    addInner(*ile,face.norm());
+}
+
+void GeoFacePolygon::addInner(const list<GeoEdge> &edges, const GeoVector &norm)
+{
+  inner.push_back(GeoPolygon2D(edges,norm));
+  inedges.push_back(&edges);
+}
+
+int GeoFacePolygon::isIn(const GeoVector &p) const
+{
+  int i;
+
+  for (i = 0; i < int(inner.size()); i++)
+    if (inner[i].isIn(p) || p.isOn(*inedges[i]))
       return 0;
 
-  return isIn(face.edges,face.norm());
+  return outer.isIn(p);
+}
+
+void GeoFacePolygon::isIn(const vector<GeoVector> &points, vector<char> *inside) const
+{
+  int i, j;
+
+  outer.isIn(points,inside);
+
+  for (i = 0; i < int(points.size()); i++)
+    if ((*inside)[i])
+      for (j = 0; j < int(inner.size()); j++)
+        if (inner[j].isIn(points[i]) || points[i].isOn(*inedges[j]))
+        {
+          (*inside)[i] = 0;
+          break;
+        }
+}
+
+int GeoVector::isIn(const list<GeoEdge> &edges, const GeoVector &norm) const
+{
+  return GeoPolygon2D(edges,norm).isIn(*this);
+}
+
+int GeoVector::isIn(const GeoFace &face) const
+{
+  return GeoFacePolygon(face).isIn(*this);
 }
 
 int GeoVector::isOn(const list<GeoEdge> &edges) const
@@ -105,6 +277,22 @@ int GeoVector::isOn(const list<GeoEdge> &edges) const
   return 0;
 }
 
+int GeoVertexCells(const GeoVector &v, GeoVertexKey *keys)
+{
+  GeoVertexKey lo, hi;
+  int x, y, z, n = 0;
+
+  lo = GeoVertexCell(v - GeoVector(GeoCurContext->epsilon,GeoCurContext->epsilon,GeoCurContext->epsilon));
+  hi = GeoVertexCell(v + GeoVector(GeoCurContext->epsilon,GeoCurContext->epsilon,GeoCurContext->epsilon));
+
+  for (x = lo.x; x <= hi.x; x++)
+    for (y = lo.y; y <= hi.y; y++)
+      for (z = lo.z; z <= hi.z; z++)
+        keys[n++] = GeoVertexKey(x,y,z);
+
+  return n;
+}
+
 GeoVector GeoFace::calculateNorm(void) const
 {
   list<GeoEdge>::const_iterator ie;
@@ -191,6 +379,138 @@ int FindReverseFace(GeoGroup &group, GeoFace &face, list<GeoFace> **rfaces, list
   return 0;
 }
 
+void MoveVertex(list<GeoFace> *faces, const GeoVector &from, const GeoVector &to)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<list<GeoEdge> >::iterator ile;
+
+  foreach (iface, *faces)
+  {
+    foreach (ie, iface->edges)
+    {
+      if (ie->v1 == from)
+        ie->v1 = to;
+
+      if (ie->v2 == from)
+        ie->v2 = to;
+    }
+
+    foreach (ile, iface->inedges)
+      foreach (ie, *ile)
+      {
+        if (ie->v1 == from)
+          ie->v1 = to;
+
+        if (ie->v2 == from)
+          ie->v2 = to;
+      }
+
+    iface->n = GeoVector(0,0,0); // force the cached normal to be recalculated
+  }
+}
+
+/*
+Moves every vertex of a nearly planar face onto its plane. The same vertices are moved in the other faces of the
+solid and in the solid owning the reverse face, so that the shared edges still match up afterwards.
+Returns the largest vertex displacement, or -1 if the face deviates from its plane by more than tolerance.
+*/
+
+double ProjectNearPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface, list<GeoFace> *rfaces, double tolerance)
+{
+  list<GeoEdge>::iterator ie;
+  list<GeoVector> verts;
+  list<GeoVector>::iterator iv;
+  GeoPlane plane;
+  GeoVector v;
+  double d, dmax = 0;
+
+  plane = iface->plane();
+
+  foreach (ie, iface->edges)
+  {
+    d = fabs(ie->v1 * plane.norm + plane.d);
+
+    if (d > tolerance)
+      return -1;
+
+    if (d > dmax)
+      dmax = d;
+
+    verts.push_back(ie->v1);
+  }
+
+  GeoDebugPrintf("Projecting near-planar face [%s] onto plane [%lg %lg %lg %lg], deviation %lg\n",
+    iface->tex.texture, plane.norm.x, plane.norm.y, plane.norm.z, plane.d, dmax);
+
+  foreach (iv, verts)
+  {
+    v = *iv - plane.norm * (*iv * plane.norm + plane.d);
+
+    MoveVertex(faces,*iv,v);
+
+    if (rfaces != NULL && rfaces != faces)
+      MoveVertex(rfaces,*iv,v);
+  }
+
+  return dmax;
+}
+
+void ProjectNearPlanarFaces(GeoSolid *solid, GeoGroup *map, double tolerance, int *nfaces, double *maxdisp)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoFace> *rfaces;
+  list<GeoFace>::iterator irface;
+  double d;
+
+  GeoCurContext->brush = solid->index;
+
+  foreach (iface, solid->faces)
+  {
+    if (iface->isPlanar())
+      continue;
+
+    if (!FindReverseFace(*map,*iface,&rfaces,&irface))
+      rfaces = NULL;
+
+    if ((d = ProjectNearPlanarFace(&solid->faces,iface,rfaces,tolerance)) < 0)
+      continue;
+
+    if (rfaces != NULL)
+      GeoPrintMessage("Projecting near-planar face by %lg units (also projecting reverse face)",d);
+    else
+      GeoPrintMessage("Projecting near-planar face by %lg units",d);
+
+    ++*nfaces;
+
+    if (d > *maxdisp)
+      *maxdisp = d;
+  }
+}
+
+void ProjectNearPlanarFaces(GeoGroup *group, GeoGroup *map, double tolerance, int *nfaces, double *maxdisp)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  list<GeoSolid>::iterator isolid;
+
+  foreach (igroup, group->groups)
+    ProjectNearPlanarFaces(&*igroup,map,tolerance,nfaces,maxdisp);
+
+  foreach (ientity, group->entities)
+  {
+    GeoCurContext->entity = ientity->index;
+
+    foreach (isolid, ientity->solids)
+      ProjectNearPlanarFaces(&*isolid,map,tolerance,nfaces,maxdisp);
+  }
+
+  GeoCurContext->entity = 0;
+
+  foreach (isolid, group->solids)
+    ProjectNearPlanarFaces(&*isolid,map,tolerance,nfaces,maxdisp);
+}
+
 void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface, list<GeoFace> *rfaces, list<GeoFace>::iterator irface)
 {
   GeoVector n, v;
@@ -211,7 +531,7 @@ void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface,
       if (ier1->isReverse(*ie1))
         break;
 
-  if (FlagGeoDebug)
+  if (GeoCurContext->flagDebug)
   {
     plane1 = iface->plane();
 
@@ -239,7 +559,7 @@ void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface,
 
     validEar = 0;
 
-    if ((ie2->vec() % ie1->rvec()) * n > 0) // if ie1 and ie2 form a convex corner
+    if (GeoTripleSign(ie2->v1,ie2->v2,ie1->v2,ie1->v1,GeoVector(0,0,0),n) > 0) // if ie1 and ie2 form a convex corner
     {
       validEar = 1;
       plane1 = GeoPlane(n % ie1->vec(),ie1->v1);
@@ -291,7 +611,7 @@ void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface,
       ieFirst = ie1;
 
 
-      if (FlagGeoDebug)
+      if (GeoCurContext->flagDebug)
       {
         GeoDebugPrintf("    Clipping ear with normal [%lg %lg %lg]\n",face.norm().x,face.norm().y,face.norm().z);
 
@@ -327,7 +647,7 @@ void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface,
         irface->edges.erase(ie2); // NOTE: this actually erases ier1
         irface->calculateNorm();
 
-        if (FlagGeoDebug)
+        if (GeoCurContext->flagDebug)
         {
           GeoDebugPrintf("    Clipping reverse ear with normal [%lg %lg %lg]\n",rface.norm().x,rface.norm().y,rface.norm().z);
 
@@ -354,7 +674,7 @@ void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface,
     }
   }
 
-  if (FlagGeoDebug)
+  if (GeoCurContext->flagDebug)
   {
     GeoDebugPrintf("  Remaining ear normal [%lg %lg %lg]\n", iface->norm().x, iface->norm().y, iface->norm().z);
 
@@ -371,8 +691,224 @@ void TesselateNonPlanarFace(list<GeoFace> *faces, list<GeoFace>::iterator iface,
   }
 }
 
+/*
+Tesselating a face also tesselates its reverse face in another solid, so with threads the pairs of faces are
+found first, in the same order and with the same reverse faces as the serial pass would find them. Pairs are
+then put in batches so that no two pairs in a batch touch the same solid, each pair going in the batch after
+the last one touching either of its solids. The pairs in each batch are tesselated in parallel, and those
+touching the same solid are tesselated in the same order as the serial pass, giving the same result.
+*/
+
+class TesselateFace
+{
+  public:
+  list<GeoFace> *faces;
+  list<GeoFace>::iterator face;
+  int entity, brush;
+};
+
+class TesselatePair
+{
+  public:
+  TesselateFace face;
+  list<GeoFace> *rfaces;
+  list<GeoFace>::iterator rface;
+  string log;
+  GeoException *error;
+};
+
+class TesselateBatch
+{
+  public:
+  vector<TesselatePair> *pairs;
+  vector<int> batch;
+};
+
+// adds the faces of the group in the order FindReverseFace() searches them
+static void CollectTesselateFaces(GeoGroup *group, int entity, vector<TesselateFace> *faces)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  list<GeoSolid>::iterator isolid;
+  TesselateFace face;
+
+  foreach (igroup, group->groups)
+    CollectTesselateFaces(&*igroup,entity,faces);
+
+  foreach (ientity, group->entities)
+    foreach (isolid, ientity->solids)
+      for (face.face = isolid->faces.begin(); face.face != isolid->faces.end(); ++face.face)
+      {
+        face.faces = &isolid->faces;
+        face.entity = ientity->index;
+        face.brush = isolid->index;
+        faces->push_back(face);
+      }
+
+  foreach (isolid, group->solids)
+    for (face.face = isolid->faces.begin(); face.face != isolid->faces.end(); ++face.face)
+    {
+      face.faces = &isolid->faces;
+      face.entity = entity;
+      face.brush = isolid->index;
+      faces->push_back(face);
+    }
+}
+
+static void RunTesselatePair(int i, void *data)
+{
+  TesselateBatch *batch = (TesselateBatch *)data;
+  TesselatePair &pair = (*batch->pairs)[batch->batch[i]];
+  string *buffer;
+
+  buffer = GeoCurContext->messages;
+  GeoCurContext->messages = &pair.log;
+  GeoCurContext->entity = pair.face.entity;
+  GeoCurContext->brush = pair.face.brush;
+
+  try
+  {
+    if (pair.rfaces != NULL)
+    {
+      GeoPrintMessage("Tesselating non-planar face (also tesselating reverse face)");
+      TesselateNonPlanarFace(pair.face.faces,pair.face.face,pair.rfaces,pair.rface);
+    }
+    else
+    {
+      GeoPrintMessage("Tesselating non-planar face");
+      TesselateNonPlanarFace(pair.face.faces,pair.face.face,NULL,pair.rface);
+    }
+  }
+
+  catch (GeoException *ex)
+  {
+    pair.error = ex;
+  }
+
+  GeoCurContext->messages = buffer;
+}
+
+// faces of group are tesselated with their reverse faces in mapgroup
+static void TesselateNonPlanarFacesParallel(GeoGroup *group, GeoGroup *mapgroup)
+{
+  vector<TesselateFace> faces, candidates;
+  vector<TesselatePair> pairs;
+  vector<vector<int> > batches;
+  map<GeoVertexKey, vector<int> > cells;
+  map<GeoVertexKey, vector<int> >::iterator icell;
+  map<list<GeoFace> *, int> last;
+  map<list<GeoFace> *, int>::iterator ilast;
+  set<GeoFace *> tesselated;
+  list<GeoEdge>::iterator ie;
+  vector<int> found;
+  GeoVertexKey keys[8];
+  TesselateBatch batch;
+  TesselatePair pair;
+  GeoException *error = NULL;
+  int i, j, k, n, b;
+
+  CollectTesselateFaces(group,0,&faces);
+  CollectTesselateFaces(mapgroup,0,&candidates);
+
+  // a reverse face has the same vertices, so candidates are indexed by their first vertex
+
+  for (i = 0; i < int(candidates.size()); i++)
+  {
+    n = GeoVertexCells(candidates[i].face->edges.front().v1,keys);
+
+    for (j = 0; j < n; j++)
+      cells[keys[j]].push_back(i);
+  }
+
+  pair.error = NULL;
+
+  for (i = 0; i < int(faces.size()); i++)
+  {
+    // faces already tesselated are triangles, which are planar and never the reverse of a non-planar face
+
+    if (tesselated.count(&*faces[i].face) || faces[i].face->isPlanar())
+      continue;
+
+    found.clear();
+
+    foreach (ie, faces[i].face->edges)
+      if ((icell = cells.find(GeoVertexCell(ie->v1))) != cells.end())
+        found.insert(found.end(),icell->second.begin(),icell->second.end());
+
+    sort(found.begin(),found.end());
+
+    pair.face = faces[i];
+    pair.rfaces = NULL;
+
+    for (j = 0; j < int(found.size()); j++)
+    {
+      TesselateFace &c = candidates[found[j]];
+
+      if (&*c.face != &*faces[i].face && !tesselated.count(&*c.face) && c.face->isReverse(*faces[i].face))
+      {
+        pair.rfaces = c.faces;
+        pair.rface = c.face;
+        break;
+      }
+    }
+
+    tesselated.insert(&*faces[i].face);
+
+    b = (ilast = last.find(pair.face.faces)) != last.end() ? ilast->second + 1 : 0;
+
+    if (pair.rfaces != NULL)
+    {
+      tesselated.insert(&*pair.rface);
+
+      if ((ilast = last.find(pair.rfaces)) != last.end() && ilast->second + 1 > b)
+        b = ilast->second + 1;
+
+      last[pair.rfaces] = b;
+    }
+
+    last[pair.face.faces] = b;
+
+    if (b == int(batches.size()))
+      batches.push_back(vector<int>());
+
+    batches[b].push_back(pairs.size());
+    pairs.push_back(pair);
+  }
+
+  GeoDebugPrintf("Tesselating %i non-planar faces in %i batches\n",int(pairs.size()),int(batches.size()));
+
+  batch.pairs = &pairs;
+
+  for (k = 0; k < int(batches.size()); k++)
+  {
+    batch.batch = batches[k];
+    GeoParallelFor(batch.batch.size(),RunTesselatePair,&batch);
+  }
+
+  for (i = 0; i < int(pairs.size()); i++)
+  {
+    GeoPrintString(pairs[i].log.c_str());
+
+    if (error == NULL)
+      error = pairs[i].error;
+    else
+      delete pairs[i].error;
+  }
+
+  fflush(stdout);
+
+  if (error != NULL)
+    throw error;
+}
+
 void TesselateNonPlanarFaces(GeoGroup *group, GeoGroup *map)
 {
+  if (GeoCurContext->threads > 0)
+  {
+    TesselateNonPlanarFacesParallel(group,map);
+    return;
+  }
+
   list<GeoGroup>::iterator igroup;
   list<GeoEntity>::iterator ientity;
   list<GeoSolid>::iterator isolid;
@@ -387,11 +923,11 @@ void TesselateNonPlanarFaces(GeoGroup *group, GeoGroup *map)
   {
     for (isolid = ientity->solids.begin(); isolid != ientity->solids.end(); isolid++)
     {
-      GeoCurEntity = ientity->index;
+      GeoCurContext->entity = ientity->index;
 
       for (iface = isolid->faces.begin(); iface != isolid->faces.end(); iface++)
       {
-        GeoCurBrush = isolid->index;
+        GeoCurContext->brush = isolid->index;
 
         if (!iface->isPlanar())
         {
@@ -414,11 +950,11 @@ void TesselateNonPlanarFaces(GeoGroup *group, GeoGroup *map)
     }
   }
 
-  GeoCurEntity = 0;
+  GeoCurContext->entity = 0;
 
   for (isolid = group->solids.begin(); isolid != group->solids.end(); isolid++)
   {
-    GeoCurBrush = isolid->index;
+    GeoCurContext->brush = isolid->index;
 
     for (iface = isolid->faces.begin(); iface != isolid->faces.end(); iface++)
     {
@@ -551,7 +1087,7 @@ void UniteCoplanarFaces(GeoSolid *solid)
           ie->v1.x, ie->v1.y, ie->v1.z, ie->v2.x, ie->v2.y, ie->v2.z,
           je->v1.x, je->v1.y, je->v1.z, je->v2.x, je->v2.y, je->v2.z);
         ie->v2 = je->v2;
-        edges.erase(je++);
+        iface->edges.erase(je++);
 
         if (je == iface->edges.end())
           je = iface->edges.begin();
@@ -562,35 +1098,274 @@ void UniteCoplanarFaces(GeoSolid *solid)
   solid->faces.splice(solid->faces.end(),faces);
 }
 
+static void UniteCoplanarFaces(list<GeoSolid> *solids)
+{
+  UniteCoplanarFaces(&solids->front());
+}
+
 void UniteCoplanarFaces(GeoGroup *group)
 {
   list<GeoGroup>::iterator igroup;
   list<GeoEntity>::iterator ientity;
   list<GeoSolid>::iterator isolid;
 
+  if (GeoCurContext->threads > 0)
+  {
+    ParallelSolidPass(group,UniteCoplanarFaces);
+    return;
+  }
+
   foreach (igroup,group->groups)
     UniteCoplanarFaces(&*igroup);
 
   foreach (ientity,group->entities)
   {
-    GeoCurEntity = ientity->index;
+    GeoCurContext->entity = ientity->index;
 
     foreach (isolid,ientity->solids)
     {
-      GeoCurBrush = isolid->index;
+      GeoCurContext->brush = isolid->index;
       UniteCoplanarFaces(&*isolid);
     }
   }
 
-  GeoCurEntity = 0;
+  GeoCurContext->entity = 0;
 
   foreach (isolid,group->solids)
   {
-    GeoCurBrush = isolid->index;
+    GeoCurContext->brush = isolid->index;
     UniteCoplanarFaces(&*isolid);
   }
 }
 
+/*
+RemoveCoincidentFaces() indexes every face in the map by the id of its plane, a plane and its reverse sharing an
+id, so that only faces in the same plane are ever compared. Faces in each plane are then swept in order of their
+bounding boxes so that only faces whose boxes overlap are compared
+*/
+
+class CoincidentFace
+{
+  public:
+  GeoFace *face;
+  GeoVector norm, lo, hi;
+  int entity, solid, plane;
+
+  bool operator<(const CoincidentFace &f) const
+  {
+    if (entity != f.entity)
+      return entity < f.entity;
+    else if (plane != f.plane)
+      return plane < f.plane;
+    else
+      return lo.x < f.lo.x;
+  }
+};
+
+class PlaneKey
+{
+  public:
+  GeoVertexKey n;
+  int d;
+
+  PlaneKey() {}
+  PlaneKey(const GeoVertexKey &tn, int td) : n(tn), d(td) {}
+
+  bool operator<(const PlaneKey &k) const
+  {
+    if (n < k.n)
+      return true;
+    else if (k.n < n)
+      return false;
+    else
+      return d < k.d;
+  }
+};
+
+class PlaneIndex
+{
+  public:
+  vector<GeoPlane> planes;
+  map<PlaneKey, vector<int> > cells;
+
+  // returns the id of an indexed plane equal to p within epsilon, or -1
+  int find(const GeoPlane &p) const
+  {
+    map<PlaneKey, vector<int> >::const_iterator icell;
+    vector<int>::const_iterator ii;
+
+    icell = cells.find(PlaneKey(GeoVertexCell(p.norm),int(floor(p.d / GeoVertexCellSize()))));
+
+    if (icell == cells.end())
+      return -1;
+
+    foreach (ii, icell->second)
+      if (planes[*ii].norm == p.norm && fequal(planes[*ii].d,p.d))
+        return *ii;
+
+    return -1;
+  }
+
+  // returns the id of the plane or its reverse, adding the plane if neither is indexed yet
+  int add(const GeoPlane &p)
+  {
+    GeoVertexKey keys[8];
+    GeoPlane r = p;
+    int i, n, d, dlo, dhi, id;
+
+    if ((id = find(p)) >= 0)
+      return id;
+
+    r.reverse();
+
+    if ((id = find(r)) >= 0)
+      return id;
+
+    id = planes.size();
+    planes.push_back(p);
+
+    n = GeoVertexCells(p.norm,keys);
+    dlo = int(floor((p.d - GeoCurContext->epsilon) / GeoVertexCellSize()));
+    dhi = int(floor((p.d + GeoCurContext->epsilon) / GeoVertexCellSize()));
+
+    for (i = 0; i < n; i++)
+      for (d = dlo; d <= dhi; d++)
+        cells[PlaneKey(keys[i],d)].push_back(id);
+
+    return id;
+  }
+};
+
+static void IndexCoincidentFaces(list<GeoSolid> *solids, int entity, PlaneIndex *planes, vector<CoincidentFace> *faces, int *nsolids)
+{
+  list<GeoSolid>::iterator isolid;
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  CoincidentFace f;
+
+  f.entity = entity;
+
+  foreach (isolid, *solids)
+  {
+    f.solid = (*nsolids)++;
+
+    foreach (iface, isolid->faces)
+    {
+      if (!iface->inedges.empty() || iface->edges.size() < 3)
+        continue;
+
+      f.face = &*iface;
+      f.norm = iface->plane().norm;
+      f.plane = planes->add(iface->plane());
+      f.lo = f.hi = iface->edges.front().v1;
+
+      foreach (ie, iface->edges)
+      {
+        f.lo.x = min(f.lo.x,ie->v1.x);
+        f.lo.y = min(f.lo.y,ie->v1.y);
+        f.lo.z = min(f.lo.z,ie->v1.z);
+        f.hi.x = max(f.hi.x,ie->v1.x);
+        f.hi.y = max(f.hi.y,ie->v1.y);
+        f.hi.z = max(f.hi.z,ie->v1.z);
+      }
+
+      faces->push_back(f);
+    }
+  }
+}
+
+// world solids are entity 0, brush entities are kept apart since they may move or be invisible
+static void IndexCoincidentFaces(GeoGroup *group, PlaneIndex *planes, vector<CoincidentFace> *faces, int *nsolids)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+
+  foreach (igroup, group->groups)
+    IndexCoincidentFaces(&*igroup,planes,faces,nsolids);
+
+  foreach (ientity, group->entities)
+    IndexCoincidentFaces(&ientity->solids,ientity->index,planes,faces,nsolids);
+
+  IndexCoincidentFaces(&group->solids,0,planes,faces,nsolids);
+}
+
+// returns 1 if every vertex of inner lies inside or on the boundary of the convex face outer
+static int ConvexFaceContains(const CoincidentFace &outer, const CoincidentFace &inner)
+{
+  list<GeoEdge>::const_iterator ie, je;
+  GeoVector e;
+
+  foreach (ie, outer.face->edges)
+  {
+    e = ie->v2 - ie->v1;
+
+    foreach (je, inner.face->edges)
+      if ((e % (je->v1 - ie->v1)) * outer.norm < -GeoCurContext->epsilon * sqrt(e * e))
+        return 0;
+  }
+
+  return 1;
+}
+
+static void MarkCoincidentFace(const CoincidentFace &f, const char *texture, int *nfaces)
+{
+  if (strcmp(f.face->tex.texture,texture) == 0)
+    return;
+
+  GeoDebugPrintf("  Face %i [%s] is hidden by a coincident face\n",f.face->index,f.face->tex.texture);
+
+  strcpy(f.face->tex.texture,texture);
+  (*nfaces)++;
+}
+
+/*
+Convex solids only. Gives the hidden texture to each face lying wholly within a back to back face of another solid
+of the same entity, and to the second of two identical faces facing the same way. Faces only partly covered are
+left alone, since a face can't be split without splitting its solid
+*/
+
+void RemoveCoincidentFaces(GeoGroup *group, const char *texture, int *nfaces)
+{
+  vector<CoincidentFace> faces;
+  PlaneIndex planes;
+  double eps = GeoCurContext->epsilon;
+  int i, j, nsolids = 0;
+
+  IndexCoincidentFaces(group,&planes,&faces,&nsolids);
+  sort(faces.begin(),faces.end());
+
+  GeoDebugPrintf("  Indexed %i faces in %i planes\n",int(faces.size()),int(planes.planes.size()));
+
+  for (i = 0; i < int(faces.size()); i++)
+  {
+    CoincidentFace &a = faces[i];
+
+    for (j = i + 1; j < int(faces.size()); j++)
+    {
+      CoincidentFace &b = faces[j];
+
+      if (b.entity != a.entity || b.plane != a.plane || b.lo.x > a.hi.x + eps)
+        break;
+
+      if (b.solid == a.solid ||
+          b.lo.y > a.hi.y + eps || a.lo.y > b.hi.y + eps ||
+          b.lo.z > a.hi.z + eps || a.lo.z > b.hi.z + eps)
+        continue;
+
+      if (a.norm * b.norm < 0)
+      {
+        if (ConvexFaceContains(b,a))
+          MarkCoincidentFace(a,texture,nfaces);
+
+        if (ConvexFaceContains(a,b))
+          MarkCoincidentFace(b,texture,nfaces);
+      }
+      else if (ConvexFaceContains(a,b) && ConvexFaceContains(b,a))
+        MarkCoincidentFace(b,texture,nfaces);
+    }
+  }
+}
+
 void PruneInvisibleObjects(GeoGroup *group, map<int,char> &vis)
 {
   list<GeoGroup>::iterator igroup;
@@ -660,6 +1435,168 @@ void PruneInvisibleObjects(GeoGroup *group, list<GeoVisGroup> *visgroups)
   PruneInvisibleObjects(group,vis);
 }
 
+/*
+A solid is degenerate if fewer than four of its faces have three or more edges of non-zero length, or if it is
+thinner than epsilon, i.e. its volume is less than epsilon times half its surface area
+*/
+
+static int IsDegenerateSolid(const GeoSolid &solid)
+{
+  list<GeoFace>::const_iterator iface;
+  list<GeoEdge>::const_iterator ie;
+  GeoVector v0, n;
+  double volume = 0, area = 0;
+  int nfaces = 0, nedges;
+
+  foreach (iface, solid.faces)
+  {
+    nedges = 0;
+
+    foreach (ie, iface->edges)
+      if (ie->v1 != ie->v2)
+        nedges++;
+
+    if (nedges < 3)
+      continue;
+
+    nfaces++;
+
+    // fan triangles from the first vertex, so that non-planar faces are measured too
+
+    v0 = iface->edges.front().v1;
+
+    foreach (ie, iface->edges)
+    {
+      n = (ie->v1 - v0) % (ie->v2 - v0);
+      volume += v0 * n;
+      area += sqrt(n * n);
+    }
+  }
+
+  return nfaces < 4 || fabs(volume) / 6 < GeoCurContext->epsilon * area / 4;
+}
+
+// v in units of epsilon rounded to whole numbers, adding 0 to turn -0 into 0, so that equal points have equal bytes
+static GeoVector CanonicalVertex(const GeoVector &v)
+{
+  return GeoVector(
+    floor(v.x / GeoCurContext->epsilon + 0.5) + 0.0,
+    floor(v.y / GeoCurContext->epsilon + 0.5) + 0.0,
+    floor(v.z / GeoCurContext->epsilon + 0.5) + 0.0);
+}
+
+/*
+The face set of a solid as a string which is the same for any ordering of its faces, or of the edges of each face
+starting at a different vertex. Vertices go in as CanonicalVertex() gives them, so that points which only differ in
+the sign of a zero or in the last bits of their coordinates still compare equal
+*/
+
+static string CanonicalFaceSet(const GeoSolid &solid)
+{
+  list<GeoFace>::const_iterator iface;
+  list<GeoEdge>::const_iterator ie;
+  vector<GeoVector> verts;
+  vector<string> faces;
+  string s;
+  int i, first;
+
+  foreach (iface, solid.faces)
+  {
+    verts.clear();
+
+    foreach (ie, iface->edges)
+      verts.push_back(CanonicalVertex(ie->v1));
+
+    first = 0;
+
+    for (i = 1; i < int(verts.size()); i++)
+      if (verts[i].x < verts[first].x || (verts[i].x == verts[first].x &&
+          (verts[i].y < verts[first].y || (verts[i].y == verts[first].y && verts[i].z < verts[first].z))))
+        first = i;
+
+    s.assign(iface->tex.texture);
+    s.push_back('\0');
+
+    for (i = 0; i < int(verts.size()); i++)
+      s.append((const char *)&verts[(first + i) % verts.size()],sizeof(GeoVector));
+
+    faces.push_back(s);
+  }
+
+  sort(faces.begin(),faces.end());
+
+  s.clear();
+
+  for (i = 0; i < int(faces.size()); i++)
+  {
+    s.append(faces[i]);
+    s.push_back('\n');
+  }
+
+  return s;
+}
+
+// with keepLast set, the last solid left is kept whatever it is, as a brush entity must have at least one
+static void RemoveDegenerateSolids(list<GeoSolid> *solids, set<string> *seen, int keepLast, int *nduplicates, int *ndegenerate)
+{
+  list<GeoSolid>::iterator isolid;
+
+  for (isolid = solids->begin(); isolid != solids->end();)
+  {
+    GeoCurContext->brush = isolid->index;
+
+    if (keepLast && solids->size() == 1)
+    {
+      if (IsDegenerateSolid(*isolid))
+        GeoPrintWarning("Keeping degenerate solid, as it is the last solid of its entity");
+
+      ++isolid;
+    }
+    else if (IsDegenerateSolid(*isolid))
+    {
+      GeoPrintMessage("Removing degenerate solid");
+      solids->erase(isolid++);
+      (*ndegenerate)++;
+    }
+    else if (!seen->insert(CanonicalFaceSet(*isolid)).second)
+    {
+      GeoPrintMessage("Removing duplicate solid");
+      solids->erase(isolid++);
+      (*nduplicates)++;
+    }
+    else
+      ++isolid;
+  }
+}
+
+static void RemoveDegenerateSolids(GeoGroup *group, set<string> *world, int *nduplicates, int *ndegenerate)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  set<string> seen;
+
+  foreach (igroup, group->groups)
+    RemoveDegenerateSolids(&*igroup,world,nduplicates,ndegenerate);
+
+  foreach (ientity, group->entities)
+  {
+    GeoCurContext->entity = ientity->index;
+    seen.clear();
+    RemoveDegenerateSolids(&ientity->solids,&seen,1,nduplicates,ndegenerate);
+  }
+
+  GeoCurContext->entity = 0;
+  RemoveDegenerateSolids(&group->solids,world,0,nduplicates,ndegenerate);
+}
+
+// duplicates are only looked for within the same entity, all world solids being one entity whatever their group
+void RemoveDegenerateSolids(GeoGroup *group, int *nduplicates, int *ndegenerate)
+{
+  set<string> world;
+
+  RemoveDegenerateSolids(group,&world,nduplicates,ndegenerate);
+}
+
 void SnapVertices(GeoSolid *solid)
 {
   list<GeoFace>::iterator iface, jface;
@@ -699,3 +1636,86 @@ void SnapVertices(GeoGroup *group)
   foreach (isolid, group->solids)
     SnapVertices(&*isolid);
 }
+
+// returns the nearest point of the grid to v, whose coordinates are exact multiples of the grid size as it is a power of two
+GeoVector GeoGridRound(const GeoVector &v)
+{
+  return GeoVector(
+    floor(v.x / GeoCurContext->gridSize + 0.5) * GeoCurContext->gridSize,
+    floor(v.y / GeoCurContext->gridSize + 0.5) * GeoCurContext->gridSize,
+    floor(v.z / GeoCurContext->gridSize + 0.5) * GeoCurContext->gridSize);
+}
+
+// returns the nearest point of the grid to v if it is equal to v within epsilon, otherwise v
+GeoVector GeoGridSnap(const GeoVector &v)
+{
+  GeoVector r;
+
+  if (GeoCurContext->gridSize == 0)
+    return v;
+
+  r = GeoGridRound(v);
+
+  return r == v ? r : v;
+}
+
+void SnapToGrid(GeoVector *v, int *nverts, double *maxdisp)
+{
+  GeoVector r;
+  double d;
+
+  r = GeoGridRound(*v);
+
+  if (r.x == v->x && r.y == v->y && r.z == v->z)
+    return;
+
+  d = sqrt((r - *v) * (r - *v));
+
+  if (d > *maxdisp)
+    *maxdisp = d;
+
+  ++*nverts;
+  *v = r;
+}
+
+void SnapToGrid(GeoSolid *solid, int *nverts, double *maxdisp)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+  list<list<GeoEdge> >::iterator ile;
+
+  foreach (iface, solid->faces)
+  {
+    // every vertex is the v1 of exactly one edge, so only v1 is counted
+
+    foreach (ie, iface->edges)
+    {
+      SnapToGrid(&ie->v1,nverts,maxdisp);
+      ie->v2 = GeoGridRound(ie->v2);
+    }
+
+    foreach (ile, iface->inedges)
+      foreach (ie, *ile)
+      {
+        SnapToGrid(&ie->v1,nverts,maxdisp);
+        ie->v2 = GeoGridRound(ie->v2);
+      }
+  }
+}
+
+void SnapToGrid(GeoGroup *group, int *nverts, double *maxdisp)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  list<GeoSolid>::iterator isolid;
+
+  foreach (igroup, group->groups)
+    SnapToGrid(&*igroup,nverts,maxdisp);
+
+  foreach (ientity, group->entities)
+    foreach (isolid, ientity->solids)
+      SnapToGrid(&*isolid,nverts,maxdisp);
+
+  foreach (isolid, group->solids)
+    SnapToGrid(&*isolid,nverts,maxdisp);
+}
@@ -15,13 +15,14 @@
 #include <cstdio>
 #include <cmath>
 #include <list>
+#include <vector>
 #include <cfloat>
 #include <cstring>
 #include <string>
 #include <cstdarg>
+#include "pred.h"
+#include "context.h"
 
-extern int FlagGeoDebug, FlagRMFDebug;
-extern double GeoEpsilon;
 void GeoDebugPrintf(const char *str, ...);
 
 #define foreach(i,list) for ((i) = (list).begin(); (i) != (list).end(); (i)++)
@@ -29,8 +30,6 @@ void GeoDebugPrintf(const char *str, ...);
 
 using namespace std;
 
-extern int GeoCurEntity, GeoCurBrush;
-
 class GeoException
 {
   public:
@@ -47,8 +46,8 @@ class GeoException
     vsprintf(msg,tomsg,args);
     va_end(args);
 
-    entity = GeoCurEntity;
-    brush = GeoCurBrush;
+    entity = GeoCurContext->entity;
+    brush = GeoCurContext->brush;
   }
 
   ~GeoException()
@@ -64,7 +63,7 @@ class GeoPlane;
 
 inline bool fequal(double a, double b)
 {
-  return fabs(a-b) <= GeoEpsilon; // after all is said and done, this seems to work the best
+  return fabs(a-b) <= GeoCurContext->epsilon; // after all is said and done, this seems to work the best
 }
 
 class GeoVector
@@ -138,14 +137,21 @@ class GeoVector
     return !operator==(v);
   }
 
+  // same as comparing the cross product of both vectors normalised with zero, but with a single sqrt
   int isParallel(const GeoVector &v) const
   {
-    GeoVector v1 = v, v2 = *this;
+    GeoVector c;
+    double m;
 
-    v1.normalize();
-    v2.normalize();
+    m = sqrt((*this * *this) * (v * v));
+
+    if (m == 0)
+      return 0;
 
-    return v1 % v2 == GeoVector(0,0,0);
+    m *= GeoCurContext->epsilon;
+    c = *this % v;
+
+    return fabs(c.x) <= m && fabs(c.y) <= m && fabs(c.z) <= m;
   }
 
   inline int isIn(const GeoPlane &p) const;
@@ -316,10 +322,13 @@ class GeoEdge
 
 inline int GeoVector::isIn(const GeoEdge &e) const
 {
+  double eps = GeoCurContext->epsilon;
+
+  // bounding box test is widened by epsilon so that the end points always count as being on the edge
   return isColinear(e) &&
-    (e.v2.x > e.v1.x ? x >= e.v1.x && x <= e.v2.x : x >= e.v2.x && x <= e.v1.x) &&
-    (e.v2.y > e.v1.y ? y >= e.v1.y && y <= e.v2.y : y >= e.v2.y && y <= e.v1.y) &&
-    (e.v2.z > e.v1.z ? z >= e.v1.z && z <= e.v2.z : z >= e.v2.z && z <= e.v1.z);
+    (e.v2.x > e.v1.x ? x >= e.v1.x-eps && x <= e.v2.x+eps : x >= e.v2.x-eps && x <= e.v1.x+eps) &&
+    (e.v2.y > e.v1.y ? y >= e.v1.y-eps && y <= e.v2.y+eps : y >= e.v2.y-eps && y <= e.v1.y+eps) &&
+    (e.v2.z > e.v1.z ? z >= e.v1.z-eps && z <= e.v2.z+eps : z >= e.v2.z-eps && z <= e.v1.z+eps);
 }
 
 inline int GeoVector::isColinear(const GeoEdge &e) const
@@ -329,17 +338,59 @@ inline int GeoVector::isColinear(const GeoEdge &e) const
 
 inline int GeoVector::isIn(const GeoEdge &e1, const GeoEdge &e2) const
 {
-  GeoVector n;
+  GeoVector n, zero(0,0,0);
 
   n = e2.vec() % e1.rvec(); // get triangle normal
 
   // test if we are on the inside of each edge of the triangle
   return
-    (e1.vec() % (*this - e1.v1)) * n > 0 &&
-    (e2.vec() % (*this - e2.v1)) * n > 0 &&
-    ((e1.v1 - e2.v2) % (*this - e2.v2)) * n > 0;
+    GeoTripleSign(e1.v1,e1.v2,e1.v1,*this,zero,n) > 0 &&
+    GeoTripleSign(e2.v1,e2.v2,e2.v1,*this,zero,n) > 0 &&
+    GeoTripleSign(e2.v2,e1.v1,e2.v2,*this,zero,n) > 0;
+}
+
+
+/*
+Cell of a grid used to index vertices by position. A vertex is stored in every cell overlapped by the box of
+points that compare equal to it (see GeoVertexCells), so looking up the single cell containing a point finds
+every indexed vertex that == the point.
+*/
+
+class GeoVertexKey
+{
+  public:
+  int x, y, z;
+
+  GeoVertexKey() {}
+  GeoVertexKey(int tx, int ty, int tz) : x(tx), y(ty), z(tz) {}
+
+  bool operator<(const GeoVertexKey &k) const
+  {
+    if (x != k.x)
+      return x < k.x;
+    else if (y != k.y)
+      return y < k.y;
+    else
+      return z < k.z;
+  }
+};
+
+inline double GeoVertexCellSize(void)
+{
+  double eps = GeoCurContext->epsilon;
+
+  return eps * 16 > 1.0/64 ? eps * 16 : 1.0/64; // must be more than twice epsilon
+}
+
+inline GeoVertexKey GeoVertexCell(const GeoVector &v)
+{
+  double size = GeoVertexCellSize();
+
+  return GeoVertexKey(int(floor(v.x / size)), int(floor(v.y / size)), int(floor(v.z / size)));
 }
 
+// stores the keys of all cells overlapped by the epsilon box around v in keys[8] and returns their number
+int GeoVertexCells(const GeoVector &v, GeoVertexKey *keys);
 
 class GeoTexture
 {
@@ -395,8 +446,9 @@ class GeoFace
   GeoVector n;
   GeoTexture tex;
   int index, flag;
+  int reflex; // number of reflex edges found by DecomposeSolids, -1 if not yet known
 
-  GeoFace() : n(GeoVector(0,0,0)), index(0) {}
+  GeoFace() : n(GeoVector(0,0,0)), index(0), reflex(-1) {}
 
   GeoVector calculateNorm(void) const;
 
@@ -513,6 +565,62 @@ class GeoFace
   }
 };
 
+/*
+Edge cycle projected onto the axis plane it is most nearly parallel to. The projected vertices are kept in flat
+arrays along with their bounding box, so that many points can be tested against the same cycle without any
+per-point plane construction. Points within epsilon of the boundary are NOT inside.
+*/
+
+class GeoPolygon2D
+{
+  public:
+  int axis; // coordinate dropped by the projection (0 = x, 1 = y, 2 = z)
+  vector<double> u, v; // projected vertices, with the first repeated at the end
+  double umin, umax, vmin, vmax;
+
+  GeoPolygon2D() {}
+  GeoPolygon2D(const list<GeoEdge> &edges, const GeoVector &norm);
+
+  void project(const GeoVector &p, double *pu, double *pv) const
+  {
+    switch (axis)
+    {
+      case 0: *pu = p.y; *pv = p.z; break;
+      case 1: *pu = p.z; *pv = p.x; break;
+      default: *pu = p.x; *pv = p.y; break;
+    }
+  }
+
+  int isIn(double pu, double pv) const;
+  int isOn(double pu, double pv) const;
+
+  int isIn(const GeoVector &p) const
+  {
+    double pu, pv;
+
+    project(p,&pu,&pv);
+    return isIn(pu,pv);
+  }
+
+  void isIn(const vector<GeoVector> &points, vector<char> *inside) const;
+};
+
+// face outer cycle minus its inner cycles, see GeoVector::isIn(const GeoFace &)
+class GeoFacePolygon
+{
+  public:
+  GeoPolygon2D outer;
+  vector<GeoPolygon2D> inner;
+  vector<const list<GeoEdge> *> inedges;
+
+  GeoFacePolygon() {}
+  GeoFacePolygon(const GeoFace &face);
+
+  void addInner(const list<GeoEdge> &edges, const GeoVector &norm);
+  int isIn(const GeoVector &p) const;
+  void isIn(const vector<GeoVector> &points, vector<char> *inside) const;
+};
+
 class GeoColor
 {
   public:
@@ -546,6 +654,9 @@ class GeoSolid : public GeoVisible
   public:
   list<GeoFace> faces;
   int index;
+  double cost; // estimated processing cost used to schedule threads (see EstimateSolidCost), 0 if not known
+
+  GeoSolid() : index(0), cost(0) {}
 };
 
 class GeoEntity : public GeoVisible
@@ -617,6 +728,8 @@ class GeoMap : public GeoGroup
   int RMFPosCorner;
 
   int MAPVersion;
+  int MAPFaces; // number of faces written by MAPWrite()
+  int MAPGridFaces; // number of those written with plane points on the grid
 
   // groups, entities and solids inherited from GeoGroup
   GeoEntityDef wsdef; // worldspawn entity definition
@@ -680,14 +793,25 @@ class GeoMap : public GeoGroup
 
 
 void GenerateTextureInfo(GeoGroup *newgroup, GeoGroup *oldgroup);
+void ProjectNearPlanarFaces(GeoGroup *group, GeoGroup *map, double tolerance, int *nfaces, double *maxdisp);
 void TesselateNonPlanarFaces(GeoGroup *group, GeoGroup *map);
 void UniteCoplanarFaces(GeoGroup *group);
-void RemoveCoincidentFaces(GeoGroup *group);
+void UniteCoplanarFaces(GeoSolid *solid);
+void RemoveCoincidentFaces(GeoGroup *group, const char *texture, int *nfaces);
 void PruneInvisibleObjects(GeoGroup *group, list<GeoVisGroup> *visgroups);
+void RemoveDegenerateSolids(GeoGroup *group, int *nduplicates, int *ndegenerate);
 void SnapVertices(GeoGroup *group);
+void SnapVertices(GeoSolid *solid);
+void SnapToGrid(GeoGroup *group, int *nverts, double *maxdisp);
+GeoVector GeoGridRound(const GeoVector &v);
+GeoVector GeoGridSnap(const GeoVector &v);
 void GeoPrintMessage(const char *str, ...);
 void GeoPrintWarning(const char *str, ...);
 
+// print to the message buffer, output function or stdout of the current context, as the functions above do
+void GeoPrintf(const char *str, ...);
+void GeoPrintString(const char *str);
+
 /*
 int CombineDuplicateVertices(RMFMap *map, float tolerance);
 int MatchCoincidentFaces(RMFMap *map);
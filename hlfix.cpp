@@ -0,0 +1,534 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <string>
+#include "geo.h"
+#include "cd.h"
+#include "bsp.h"
+#include "merge.h"
+#include "cache.h"
+#include "bench.h"
+#include "pool.h"
+#include "hlfix.h"
+
+using namespace std;
+
+struct HLFixMap
+{
+  GeoContext context;
+  GeoMap map;
+  GeoSolidCache cache;
+  HLFixOptions options;
+  string coincident, cacheoptions;
+  int nsolidsRead, nsolidsProcessed;
+};
+
+struct HLFixCache
+{
+  GeoSolidStore store;
+};
+
+static void ClearError(HLFixError *error)
+{
+  if (error != NULL)
+    memset(error,0,sizeof(HLFixError));
+}
+
+static int SetError(HLFixError *error, int code, const char *msg, int entity, int brush)
+{
+  if (error != NULL)
+  {
+    error->code = code;
+    strncpy(error->msg,msg,sizeof(error->msg)-1);
+    error->msg[sizeof(error->msg)-1] = '\0';
+    error->entity = entity;
+    error->brush = brush;
+  }
+
+  return code;
+}
+
+static void DiscardMessage(const char *, void *)
+{
+}
+
+static int CountSolids(GeoGroup *group)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  int n;
+
+  n = group->solids.size();
+
+  foreach (ientity, group->entities)
+    n += ientity->solids.size();
+
+  foreach (igroup, group->groups)
+    n += CountSolids(&*igroup);
+
+  return n;
+}
+
+void HLFixDefaultOptions(HLFixOptions *options)
+{
+  memset(options,0,sizeof(HLFixOptions));
+
+  options->epsilon = 1;
+  options->removeDegenerate = options->tesselate = options->decompose = options->unite = 1;
+  options->cacheSize = 256;
+  options->mapVersion = 220;
+}
+
+static const char *CheckOptions(const HLFixOptions *options)
+{
+  int exp;
+
+  if (!(options->epsilon > 0))
+    return "invalid epsilon factor";
+
+  if (options->project && !(options->projectTolerance >= 0))
+    return "invalid projection tolerance";
+
+  if (!(options->grid >= 0) || (options->grid > 0 && frexp(options->grid,&exp) != 0.5))
+    return "invalid grid size";
+
+  if (options->threads < 0)
+    return "invalid number of threads";
+
+  if (options->cacheDir != NULL && strlen(options->cacheDir) > FILENAME_MAX)
+    return "cache directory name too long";
+
+  if (!(options->cacheSize >= 0))
+    return "invalid cache size";
+
+  if (options->mapVersion != 220 && options->mapVersion != 100)
+    return "invalid MAP version";
+
+  return NULL;
+}
+
+// sets up the context, cache and copies of the strings of the options
+static void SetOptions(HLFixMap *map, const HLFixOptions *options)
+{
+  GeoContext &context = map->context;
+  HLFixOptions &o = map->options;
+  char buf[256];
+
+  o = *options;
+
+  if (o.coincident != NULL)
+  {
+    map->coincident = o.coincident;
+    o.coincident = map->coincident.c_str();
+  }
+
+  o.cacheDir = NULL;
+
+  context.epsilon = (double) o.epsilon * 0.004;
+  context.gridSize = o.grid;
+  context.flagDebug = o.debug;
+  context.flagStats = o.stats;
+  context.flagRMFDebug = o.rmfDebug;
+  context.decomposeMode = o.decomposeCost ? DECOMPOSE_COST : DECOMPOSE_REFLEX;
+  context.flagDecomposeMemo = o.decomposeMemo;
+  context.threads = o.threads;
+  context.output = o.message != NULL ? o.message : DiscardMessage;
+  context.outputData = o.messageData;
+
+  map->map.MAPVersion = o.mapVersion;
+  map->map.MAPFaces = map->map.MAPGridFaces = 0;
+
+  if (options->cacheDir != NULL)
+    strcpy(map->cache.dir,options->cacheDir);
+
+  if (options->cache != NULL)
+    map->cache.memory = &options->cache->store;
+
+  // everything that changes how a solid is processed goes in the cache key
+
+  snprintf(buf,sizeof(buf),"hlfix %s e%g p%i:%g s%g t%i d%i:%i:%i:%i m%i u%i\n",HLFIX_VERSION,o.epsilon,o.project,o.projectTolerance,
+    o.grid,o.tesselate,o.decompose,o.decomposeBSP,context.decomposeMode,o.decomposeMemo,o.merge,o.unite);
+  map->cacheoptions = buf;
+  map->cache.options = map->cacheoptions;
+  map->cache.maxbytes = long(o.cacheSize * 1048576);
+  map->cache.skipNonPlanar = o.project || o.tesselate;
+}
+
+HLFixMap *HLFixLoad(const void *rmf, size_t size, const HLFixOptions *options, HLFixError *error)
+{
+  HLFixMap *map;
+  const char *msg;
+  FILE *f;
+
+  ClearError(error);
+
+  if ((rmf == NULL && size > 0) || options == NULL)
+  {
+    SetError(error,HLFIX_ERROR_ARGUMENT,"missing input or options",0,0);
+    return NULL;
+  }
+
+  if ((msg = CheckOptions(options)) != NULL)
+  {
+    SetError(error,HLFIX_ERROR_ARGUMENT,msg,0,0);
+    return NULL;
+  }
+
+  map = new HLFixMap;
+  SetOptions(map,options);
+
+  GeoContextScope scope(&map->context);
+
+  if ((f = fmemopen((void *)rmf,size,"rb")) == NULL)
+  {
+    SetError(error,HLFIX_ERROR_READ,"Premature EOF reading header",0,0);
+    delete map;
+    return NULL;
+  }
+
+  try
+  {
+    map->map.RMFRead(f);
+  }
+
+  catch (GeoException *ex)
+  {
+    GeoMap &m = map->map;
+
+    SetError(error,HLFIX_ERROR_READ,ex->msg,m.RMFPosEntity,m.RMFPosSolid);
+
+    if (error != NULL)
+    {
+      error->offset = m.RMFPos;
+      error->face = m.RMFPosFace;
+      error->vector = m.RMFPosVector;
+      error->key = m.RMFPosKey;
+      error->path = m.RMFPosPath;
+      error->corner = m.RMFPosCorner;
+      error->visgroup = m.RMFPosVisGroup;
+    }
+
+    delete ex;
+    fclose(f);
+    delete map;
+    return NULL;
+  }
+
+  fclose(f);
+
+  map->nsolidsRead = map->nsolidsProcessed = CountSolids(&map->map);
+
+  return map;
+}
+
+int HLFixAddWad(HLFixMap *map, const char *wad)
+{
+  if (map == NULL || wad == NULL)
+    return HLFIX_ERROR_ARGUMENT;
+
+  map->map.wads.push_back(string(wad));
+  return HLFIX_OK;
+}
+
+int HLFixProcess(HLFixMap *map, HLFixError *error)
+{
+  int code = HLFIX_OK;
+  int nbefore, nafter, nfaces, nverts;
+  double maxdisp;
+
+  ClearError(error);
+
+  if (map == NULL)
+    return SetError(error,HLFIX_ERROR_ARGUMENT,"missing map",0,0);
+
+  GeoContextScope scope(&map->context);
+  HLFixOptions &o = map->options;
+  GeoMap &m = map->map;
+  GeoSolidCache &cache = map->cache;
+
+  try
+  {
+    if (o.visibleOnly)
+    {
+      GeoPrintf("Pruning invisible objects\n");
+      PruneInvisibleObjects(&m,&m.visgroups);
+    }
+
+    if (o.removeDegenerate)
+    {
+      GeoPrintf("Removing duplicate and degenerate solids\n");
+      nbefore = nafter = 0;
+      RemoveDegenerateSolids(&m,&nbefore,&nafter);
+      GeoPrintf("  %i duplicate and %i degenerate solids removed\n",nbefore,nafter);
+    }
+
+    GeoPrintf("Snapping vertices\n");
+    SnapVertices(&m);
+
+    if (GeoCurContext->gridSize > 0)
+    {
+      GeoPrintf("Snapping vertices to grid %lg\n",GeoCurContext->gridSize);
+      nverts = 0;
+      maxdisp = 0;
+      SnapToGrid(&m,&nverts,&maxdisp);
+      GeoPrintf("  %i face vertices moved, maximum displacement %lg\n",nverts,maxdisp);
+    }
+
+    // solids are looked up once snapped, as snapping decides which faces are still non-planar
+
+    if (cache.enabled() && !o.benchmark)
+    {
+      GeoPrintf("Loading cached solids from %s\n",cache.dir[0] != '\0' ? cache.dir : "memory");
+      cache.load(&m);
+      GeoPrintf("  %i solids loaded, %i to process\n",cache.nhits,cache.nmisses);
+    }
+
+    if (GeoCurContext->threads > 0)
+    {
+      GeoPrintf("Estimating the cost of processing each solid\n");
+      EstimateSolidCosts(&m);
+    }
+
+    if (o.project)
+    {
+      GeoPrintf("Projecting near-planar faces\n");
+      nfaces = 0;
+      maxdisp = 0;
+      ProjectNearPlanarFaces(&m,&m,o.projectTolerance,&nfaces,&maxdisp);
+      GeoPrintf("  %i faces projected, maximum vertex displacement %lg\n",nfaces,maxdisp);
+    }
+
+    if (o.tesselate)
+    {
+      GeoPrintf("Tesselating non-planar faces\n");
+      TesselateNonPlanarFaces(&m,&m);
+    }
+
+    if (o.benchmark)
+    {
+      RunBenchmarks(&m);
+      return HLFIX_OK;
+    }
+
+    if (o.decompose)
+    {
+      GeoPrintf("Decomposing non-convex solids\n");
+
+      if (o.decomposeBSP)
+        DecomposeGroupBSP(&m);
+      else
+        DecomposeGroup(&m);
+
+      if (GeoCurContext->flagStats)
+        PrintDecomposeStats();
+
+      if (o.merge)
+      {
+        GeoPrintf("Merging convex pieces\n");
+        nbefore = nafter = 0;
+        MergeConvexPieces(&m,&nbefore,&nafter);
+        GeoPrintf("  %i solids merged into %i\n",nbefore,nafter);
+      }
+    }
+
+    if (GeoCurContext->flagStats)
+      GeoPrintf("  %i of %i exact predicate evaluations needed the exact fallback\n",
+        GeoCurContext->predicates.nexact, GeoCurContext->predicates.nexact + GeoCurContext->predicates.nfiltered);
+
+    if (o.unite)
+    {
+      GeoPrintf("Uniting coplanar faces\n");
+      UniteCoplanarFaces(&m);
+    }
+
+    if (cache.enabled())
+    {
+      GeoPrintf("Storing processed solids in %s\n",cache.dir[0] != '\0' ? cache.dir : "memory");
+      cache.store(&m);
+      cache.restore(&m);
+      cache.evict();
+      GeoPrintf("  %i solids stored, %i old files removed\n",cache.nstored,cache.nevicted);
+    }
+
+    if (o.coincident != NULL)
+    {
+      GeoPrintf("Removing coincident faces\n");
+      nfaces = 0;
+      RemoveCoincidentFaces(&m,o.coincident,&nfaces);
+      GeoPrintf("  %i hidden faces given texture %s\n",nfaces,o.coincident);
+    }
+  }
+
+  catch (GeoException *ex)
+  {
+    code = SetError(error,HLFIX_ERROR_GEOMETRY,ex->msg,ex->entity,ex->brush);
+    delete ex;
+  }
+
+  // solids loaded from the cache are still held if a pass failed
+
+  cache.restore(&m);
+
+  map->nsolidsProcessed = CountSolids(&m);
+
+  return code;
+}
+
+int HLFixWrite(HLFixMap *map, HLFixWriteFunc write, void *data, HLFixError *error)
+{
+  int code = HLFIX_OK;
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *f;
+
+  ClearError(error);
+
+  if (map == NULL || write == NULL)
+    return SetError(error,HLFIX_ERROR_ARGUMENT,"missing map or write function",0,0);
+
+  GeoContextScope scope(&map->context);
+
+  if ((f = open_memstream(&buf,&size)) == NULL)
+    return SetError(error,HLFIX_ERROR_WRITE,"can't open memory stream",0,0);
+
+  try
+  {
+    if (map->options.writeRMF)
+      map->map.RMFWrite(f);
+    else
+      map->map.MAPWrite(f);
+  }
+
+  catch (GeoException *ex)
+  {
+    code = SetError(error,HLFIX_ERROR_GEOMETRY,ex->msg,ex->entity,ex->brush);
+    delete ex;
+  }
+
+  fclose(f);
+
+  if (size > 0 && !write(buf,size,data) && code == HLFIX_OK)
+    code = SetError(error,HLFIX_ERROR_WRITE,"write function failed",0,0);
+
+  free(buf);
+
+  return code;
+}
+
+class HLFixBuffer
+{
+  public:
+  char *buf;
+  size_t size, written;
+};
+
+static int WriteBuffer(const void *buf, size_t size, void *data)
+{
+  HLFixBuffer *buffer = (HLFixBuffer *)data;
+
+  if (size <= buffer->size)
+    memcpy(buffer->buf,buf,size);
+
+  buffer->written = size;
+  return 1;
+}
+
+int HLFixWriteBuffer(HLFixMap *map, void *buf, size_t size, size_t *written, HLFixError *error)
+{
+  HLFixBuffer buffer;
+  int code;
+
+  if (buf == NULL && size > 0)
+  {
+    ClearError(error);
+    return SetError(error,HLFIX_ERROR_ARGUMENT,"missing buffer",0,0);
+  }
+
+  buffer.buf = (char *)buf;
+  buffer.size = size;
+  buffer.written = 0;
+
+  code = HLFixWrite(map,WriteBuffer,&buffer,error);
+
+  if (written != NULL)
+    *written = buffer.written;
+
+  if (code == HLFIX_OK && buffer.written > size)
+    code = SetError(error,HLFIX_ERROR_BUFFER,"output doesn't fit in the buffer",0,0);
+
+  return code;
+}
+
+void HLFixGetStats(const HLFixMap *map, HLFixStats *stats)
+{
+  memset(stats,0,sizeof(HLFixStats));
+
+  if (map == NULL)
+    return;
+
+  stats->nsolidsRead = map->nsolidsRead;
+  stats->nsolidsProcessed = map->nsolidsProcessed;
+  stats->nsolidsCached = map->cache.nhits;
+  stats->nfaces = map->map.MAPFaces;
+  stats->ngridFaces = map->map.MAPGridFaces;
+}
+
+void HLFixFree(HLFixMap *map)
+{
+  delete map;
+}
+
+HLFixCache *HLFixCreateCache(float megabytes)
+{
+  HLFixCache *cache;
+
+  if (!(megabytes >= 0))
+    return NULL;
+
+  cache = new HLFixCache;
+  cache->store.maxbytes = long(megabytes * 1048576);
+
+  return cache;
+}
+
+void HLFixFreeCache(HLFixCache *cache)
+{
+  delete cache;
+}
+
+int HLFixConvert(const void *rmf, size_t size, const HLFixOptions *options, HLFixWriteFunc write, void *data, HLFixError *error)
+{
+  HLFixError local, processError;
+  HLFixMap *map;
+  int code;
+
+  if (error == NULL)
+    error = &local;
+
+  if ((map = HLFixLoad(rmf,size,options,error)) == NULL)
+    return error->code;
+
+  HLFixProcess(map,&processError);
+  code = HLFixWrite(map,write,data,error);
+
+  if (processError.code != HLFIX_OK && code != HLFIX_ERROR_WRITE)
+  {
+    *error = processError;
+    code = processError.code;
+  }
+
+  HLFixFree(map);
+
+  return code;
+}
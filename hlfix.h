@@ -0,0 +1,152 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_HLFIX
+#define _INC_HLFIX
+
+#include <stddef.h>
+
+#define HLFIX_VERSION "0.9b"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+C interface of libhlfix, for converting maps without going through files. A map is loaded from an RMF image in
+memory, processed by the passes its options choose and written as MAP or RMF to a function or buffer. Nothing is
+printed: messages are passed to the message function of the options, and errors are returned. Each map has a
+context of its own, so different maps may be converted on different threads at the same time, but a map must only
+be used by one thread at a time.
+
+The threads solids are processed on are shared by the whole process. They are started by the first thread to
+process a map with threads above 1, as many as it asks for, and only serve that thread. Maps processed on any other
+thread have their solids processed on the calling thread alone, though the output is the same
+*/
+
+enum
+{
+  HLFIX_OK,
+  HLFIX_ERROR_ARGUMENT, // invalid options or arguments
+  HLFIX_ERROR_READ, // the input isn't a valid RMF image
+  HLFIX_ERROR_GEOMETRY, // a pass or the writer failed on a solid, the map is left as it was at that point
+  HLFIX_ERROR_WRITE, // the write function failed
+  HLFIX_ERROR_BUFFER // the output didn't fit in the buffer
+};
+
+typedef struct HLFixError
+{
+  int code;
+  char msg[1000];
+  int entity, brush; // the solid a geometry error was in, or the entity and brush being read when reading failed
+  int offset, face, vector, key, path, corner, visgroup; // the rest of where reading failed
+} HLFixError;
+
+// passed each message as it is printed, str being one or more lines or the start of one
+typedef void (*HLFixMessageFunc)(const char *str, void *data);
+
+// passed the output, returns 0 if it couldn't be written
+typedef int (*HLFixWriteFunc)(const void *buf, size_t size, void *data);
+
+typedef struct HLFixCache HLFixCache;
+
+// the command line option of each is given in brackets
+typedef struct HLFixOptions
+{
+  float epsilon; // epsilon factor for numeric comparisons, 1.0 by default (-e)
+  int project; // project faces within projectTolerance of planar instead of tesselating them (-p)
+  float projectTolerance;
+  float grid; // snap vertices to a grid this size, which must be a power of two, and write plane points on it, or 0 (-s)
+  int visibleOnly; // process and write visible objects only (-v)
+  int removeDegenerate; // remove duplicate and degenerate solids, set by default (-nr)
+  int tesselate; // tesselate non-planar faces, set by default (-nt)
+  int decompose; // decompose non-convex solids, set by default (-nd)
+  int decomposeBSP; // decompose with a BSP tree (-db)
+  int decomposeCost; // choose cut planes with a cost model (-dc)
+  int decomposeMemo; // reuse the decomposition of identical solids (-dr)
+  int merge; // merge decomposed pieces whose union is convex (-dm)
+  int unite; // unite coplanar faces, set by default (-nu)
+  const char *coincident; // texture given to faces hidden by a coincident face, or NULL to leave them (-c)
+  int threads; // threads to process solids on, or 0 for the serial passes (-j), see above for which threads use them
+  const char *cacheDir; // directory to cache processed solids in, or NULL (-k)
+  float cacheSize; // megabytes the cache directory is kept within, 256 by default (-ks)
+  HLFixCache *cache; // processed solids kept in memory and shared with other maps, or NULL (--serve)
+  int mapVersion; // 220 by default, or 100 (-m)
+  int writeRMF; // write RMF instead of MAP (-r)
+  int stats; // print pass statistics (-gs)
+  int debug; // print geometry debugging messages (-gd)
+  int rmfDebug; // print the RMF as it is read (-rd)
+  int benchmark; // benchmark the kernels on the map after tesselating it instead of processing it, printed to stdout (-gb)
+  HLFixMessageFunc message; // NULL to discard messages
+  void *messageData;
+} HLFixOptions;
+
+typedef struct HLFixStats
+{
+  int nsolidsRead; // solids in the map when it was loaded
+  int nsolidsProcessed; // solids in the map after processing
+  int nsolidsCached; // solids loaded from a cache instead of being processed
+  int nfaces; // faces written to the last MAP
+  int ngridFaces; // of those, faces written with plane points on the grid
+} HLFixStats;
+
+typedef struct HLFixMap HLFixMap;
+
+// sets the options the program has with no command line options
+void HLFixDefaultOptions(HLFixOptions *options);
+
+// loads a map from an RMF image, keeping a copy of the options. Returns NULL on failure
+HLFixMap *HLFixLoad(const void *rmf, size_t size, const HLFixOptions *options, HLFixError *error);
+
+// adds a wad to the list written in the worldspawn entity of a MAP
+int HLFixAddWad(HLFixMap *map, const char *wad);
+
+/*
+Runs the passes chosen by the options over the map. If one fails the error is returned and the passes after it
+are skipped, but the map can still be written
+*/
+
+int HLFixProcess(HLFixMap *map, HLFixError *error);
+
+// writes the map in one call to write. Anything written before a geometry error is still passed to write
+int HLFixWrite(HLFixMap *map, HLFixWriteFunc write, void *data, HLFixError *error);
+
+/*
+Writes the map into buf, setting *written to its size. If it doesn't fit, nothing is written, HLFIX_ERROR_BUFFER is
+returned and *written is set to the size needed
+*/
+
+int HLFixWriteBuffer(HLFixMap *map, void *buf, size_t size, size_t *written, HLFixError *error);
+
+void HLFixGetStats(const HLFixMap *map, HLFixStats *stats);
+void HLFixFree(HLFixMap *map);
+
+/*
+Creates a cache of processed solids kept in memory within the given megabytes, to be shared by the maps given it in
+their options, on any thread. It must outlive them. Solids whose processing depends on their neighbours, those with
+non-planar faces when projecting or tesselating, are never kept, so maps sharing it can't get each other's
+*/
+
+HLFixCache *HLFixCreateCache(float megabytes);
+void HLFixFreeCache(HLFixCache *cache);
+
+/*
+Loads, processes and writes a map in one call. If processing fails the map is still written and the processing
+error returned
+*/
+
+int HLFixConvert(const void *rmf, size_t size, const HLFixOptions *options, HLFixWriteFunc write, void *data, HLFixError *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include "geo.h"
+#include "kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/*
+All double precision kernels compute the plane distance in the same order as GeoVector::operator*() and do not
+contract multiplies and adds, so every kernel gives bit for bit the same answer as GeoVector::sideOf()
+*/
+
+void GeoClassifyScalar(const double *x, const double *y, const double *z, int n, const GeoPlane &plane, double eps, signed char *side)
+{
+  double d;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    d = -(x[i]*plane.norm.x + y[i]*plane.norm.y + z[i]*plane.norm.z);
+
+    if (fabs(d-plane.d) <= eps)
+      side[i] = SIDE_IN;
+    else if (d < plane.d)
+      side[i] = SIDE_FRONT;
+    else
+      side[i] = SIDE_BACK;
+  }
+}
+
+#ifdef KERNEL_X86
+
+/*
+Sides of four lanes for each combination of the "in" and "front" mask bits. It is filled once, before any vector
+kernel is handed out by GeoClassifyKernels(), and only read after that, since kernels on other threads may be
+reading it whenever the list is fetched again
+*/
+
+static signed char KernelSides[16][16][4];
+static once_flag KernelSidesOnce;
+
+static void FillKernelSides(void)
+{
+  int in, front, j;
+
+  for (in = 0; in < 16; in++)
+    for (front = 0; front < 16; front++)
+      for (j = 0; j < 4; j++)
+        KernelSides[in][front][j] = (in & (1 << j)) ? SIDE_IN : (front & (1 << j)) ? SIDE_FRONT : SIDE_BACK;
+}
+
+void GeoClassifySSE2(const double *x, const double *y, const double *z, int n, const GeoPlane &plane, double eps, signed char *side)
+{
+  __m128d nx, ny, nz, pd, veps, sign, d, dd;
+  int i, in, front;
+
+  nx = _mm_set1_pd(plane.norm.x);
+  ny = _mm_set1_pd(plane.norm.y);
+  nz = _mm_set1_pd(plane.norm.z);
+  pd = _mm_set1_pd(plane.d);
+  veps = _mm_set1_pd(eps);
+  sign = _mm_set1_pd(-0.0);
+
+  for (i = 0; i + 2 <= n; i += 2)
+  {
+    d = _mm_mul_pd(_mm_loadu_pd(x+i),nx);
+    d = _mm_add_pd(d,_mm_mul_pd(_mm_loadu_pd(y+i),ny));
+    d = _mm_add_pd(d,_mm_mul_pd(_mm_loadu_pd(z+i),nz));
+    d = _mm_xor_pd(d,sign);
+
+    dd = _mm_andnot_pd(sign,_mm_sub_pd(d,pd));
+    in = _mm_movemask_pd(_mm_cmple_pd(dd,veps));
+    front = _mm_movemask_pd(_mm_cmplt_pd(d,pd));
+
+    memcpy(side+i,KernelSides[in][front],2);
+  }
+
+  GeoClassifyScalar(x+i,y+i,z+i,n-i,plane,eps,side+i);
+}
+
+__attribute__((target("avx2")))
+void GeoClassifyAVX2(const double *x, const double *y, const double *z, int n, const GeoPlane &plane, double eps, signed char *side)
+{
+  __m256d nx, ny, nz, pd, veps, sign, d, dd;
+  int i, in, front;
+
+  nx = _mm256_set1_pd(plane.norm.x);
+  ny = _mm256_set1_pd(plane.norm.y);
+  nz = _mm256_set1_pd(plane.norm.z);
+  pd = _mm256_set1_pd(plane.d);
+  veps = _mm256_set1_pd(eps);
+  sign = _mm256_set1_pd(-0.0);
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    d = _mm256_mul_pd(_mm256_loadu_pd(x+i),nx);
+    d = _mm256_add_pd(d,_mm256_mul_pd(_mm256_loadu_pd(y+i),ny));
+    d = _mm256_add_pd(d,_mm256_mul_pd(_mm256_loadu_pd(z+i),nz));
+    d = _mm256_xor_pd(d,sign);
+
+    dd = _mm256_andnot_pd(sign,_mm256_sub_pd(d,pd));
+    in = _mm256_movemask_pd(_mm256_cmp_pd(dd,veps,_CMP_LE_OQ));
+    front = _mm256_movemask_pd(_mm256_cmp_pd(d,pd,_CMP_LT_OQ));
+
+    memcpy(side+i,KernelSides[in][front],4);
+  }
+
+  // avoid the AVX to SSE transition penalty in the caller and the scalar tail
+  _mm256_zeroupper();
+
+  GeoClassifyScalar(x+i,y+i,z+i,n-i,plane,eps,side+i);
+}
+
+#endif
+
+vector<GeoClassifyKernel> GeoClassifyKernels(void)
+{
+  vector<GeoClassifyKernel> kernels;
+  GeoClassifyKernel k;
+
+  k.name = "scalar";
+  k.func = GeoClassifyScalar;
+  kernels.push_back(k);
+
+#ifdef KERNEL_X86
+  call_once(KernelSidesOnce,FillKernelSides);
+
+  k.name = "SSE2";
+  k.func = GeoClassifySSE2;
+  kernels.push_back(k);
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    k.name = "AVX2";
+    k.func = GeoClassifyAVX2;
+    kernels.push_back(k);
+  }
+#endif
+
+  return kernels;
+}
+
+void GeoClassifyPoints(const GeoPointArray &points, const GeoPlane &plane, signed char *side)
+{
+  static GeoClassifyFunc classify = GeoClassifyKernels().back().func;
+
+  if (points.size() > 0)
+    classify(&points.x[0],&points.y[0],&points.z[0],points.size(),plane,GeoCurContext->epsilon,side);
+}
@@ -0,0 +1,69 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_KERNEL
+#define _INC_KERNEL
+
+#include <vector>
+#include "geo.h"
+
+using namespace std;
+
+/*
+Points stored as one array per coordinate, so that they can be classified against a plane several at a time
+*/
+
+class GeoPointArray
+{
+  public:
+  vector<double> x, y, z;
+
+  void clear(void)
+  {
+    x.clear();
+    y.clear();
+    z.clear();
+  }
+
+  void push_back(const GeoVector &v)
+  {
+    x.push_back(v.x);
+    y.push_back(v.y);
+    z.push_back(v.z);
+  }
+
+  int size(void) const
+  {
+    return x.size();
+  }
+};
+
+/*
+Stores SIDE_FRONT, SIDE_IN or SIDE_BACK for each of the n points in side[], with exactly the same result as
+GeoVector::sideOf() using eps as the tolerance
+*/
+
+typedef void (*GeoClassifyFunc)(const double *x, const double *y, const double *z, int n, const GeoPlane &plane, double eps, signed char *side);
+
+class GeoClassifyKernel
+{
+  public:
+  const char *name;
+  GeoClassifyFunc func;
+};
+
+// returns the kernels this CPU can run, slowest first
+vector<GeoClassifyKernel> GeoClassifyKernels(void);
+
+// classifies points with the fastest kernel this CPU can run
+void GeoClassifyPoints(const GeoPointArray &points, const GeoPlane &plane, signed char *side);
+
+#endif
@@ -10,8 +10,15 @@
 
 #include <cstdio>
 #include <cctype>
-#include "geo.h"
-#include "cd.h"
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hlfix.h"
+#include "main.h"
+#include "batch.h"
+#include "server.h"
 
 using namespace std;
 
@@ -142,112 +149,323 @@ void strtolower(char *str)
   }
 }
 
-int main(int argc, char **argv)
+// the library's messages are printed as they come
+void PrintMessage(const char *str, void *)
+{
+  fputs(str,stdout);
+}
+
+int WriteFile(const void *buf, size_t size, void *data)
+{
+  return fwrite(buf,size,1,(FILE *)data) == 1;
+}
+
+int ReadFile(FILE *f, vector<char> *buf)
+{
+  char chunk[65536];
+  size_t n;
+
+  while ((n = fread(chunk,1,sizeof(chunk),f)) > 0)
+    buf->insert(buf->end(),chunk,chunk+n);
+
+  return !ferror(f);
+}
+
+int ReadWadList(const char *fn, vector<string> *wads)
 {
-  FILE *fwad, *fout, *frmf;
-  GeoMap map;
-  float efactor = 1;
-  int i, flagWriteRMF, flagWAD, flagTesselate, flagDecompose, flagUnite, flagVisibleOnly;
   char wadfn[FILENAME_MAX+1];
-  char outfn[FILENAME_MAX+1];
-  char rmffn[FILENAME_MAX+1];
+  FILE *fwad;
+
+  printf("Reading wad list file %s... ",fn);
+  fflush(stdout);
+
+  if ((fwad = fopen(fn,"r")) == NULL)
+  {
+    printf("can't open %s\n",fn);
+    return 0;
+  }
+
+  while (fgets(wadfn,FILENAME_MAX+1,fwad) != NULL)
+  {
+    Chop(wadfn);
+    wads->push_back(wadfn);
+  }
+
+  fclose(fwad);
+  printf("done\n");
+  return 1;
+}
+
+void PrintError(const HLFixError &error)
+{
+  if (error.code == HLFIX_ERROR_GEOMETRY)
+    printf("  ERROR (Entity %i, Brush %i): %s\n",error.entity, error.brush, error.msg);
+  else
+    printf("  ERROR: %s\n",error.msg);
+}
+
+CommandLine::CommandLine()
+{
+  wadfn[0] = outfn[0] = rmffn[0] = cachedir[0] = listfn[0] = socketfn[0] = '\0';
+  strcpy(hiddentex,"NULL");
+  flagWAD = flagThreads = 0;
+  batchMemory = 1024;
+  serveMemory = 256;
+  HLFixDefaultOptions(&options);
+}
+
+// copies an argument into one of the filename buffers of CommandLine
+static void CopyFileName(char *fn, const char *arg)
+{
+  if (strlen(arg) > FILENAME_MAX)
+    throw "filename too long";
+
+  strcpy(fn,arg);
+}
+
+void AddExtension(char *fn, const char *ext)
+{
+  if (strlen(fn) + strlen(ext) > FILENAME_MAX)
+    throw "filename too long";
+
+  strcat(fn,ext);
+}
+
+void ParseCommandLine(int argc, char **argv, CommandLine *cl)
+{
   char option[FILENAME_MAX+1];
+  int i, exp, flagCoincident = 0;
 
-  wadfn[0] = outfn[0] = rmffn[0] = '\0';
-  FlagGeoDebug = FlagRMFDebug = flagWriteRMF = flagWAD = flagVisibleOnly = 0;
-  flagTesselate = flagDecompose = flagUnite = 1;
-  map.MAPVersion = 220;
+  // options take their values from the arguments after them, so all are checked first
 
-  printf("hlfix v0.9b by Jedediah Smith - http://extension.ws/hlfix/\n");
+  for (i = 1; i < argc; i++)
+    if (strlen(argv[i]) > FILENAME_MAX)
+      throw "command line argument too long";
 
-  try
+  for (i = 1; i < argc; i++)
   {
-    for (i = 1; i < argc; i++)
+    if (argv[i][0] == '-')
     {
-      if (argv[i][0] == '-')
-      {
-        strncpy(option,argv[i]+1,100);
+      strncpy(option,argv[i]+1,100);
 
-        if (option[99] != '\0')
-          throw "invalid command line option";
+      if (option[99] != '\0')
+        throw "invalid command line option";
 
-        strtolower(option);
+      strtolower(option);
 
-        if (strcmp(option,"w") == 0)
-        {
-               flagWAD = 1;
+      if (strcmp(option,"w") == 0)
+      {
+             cl->flagWAD = 1;
 
-               if (++i < argc && argv[i][0] != '-')
-                  strcpy(wadfn,argv[i]);
-               else
-                  --i;
-        }
-        else if (strcmp(option,"o") == 0)
-        {
-          i++;
-          if (argc <= i) throw "missing output filename";
-          strcpy(outfn,argv[i]);
-        }
-        else if (strcmp(option,"e") == 0)
+             if (++i < argc && argv[i][0] != '-')
+                CopyFileName(cl->wadfn,argv[i]);
+             else
+                --i;
+      }
+      else if (strcmp(option,"o") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing output filename";
+        CopyFileName(cl->outfn,argv[i]);
+      }
+      else if (strcmp(option,"e") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing epsilon factor";
+        if (!ParseFloat(&cl->options.epsilon,argv[i]))
+          throw "invalid epsilon factor";
+      }
+      else if (strcmp(option,"p") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing projection tolerance";
+        if (!ParseFloat(&cl->options.projectTolerance,argv[i]))
+          throw "invalid projection tolerance";
+        cl->options.project = 1;
+      }
+      else if (strcmp(option,"s") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing grid size";
+        // only a power of two grid keeps snapped coordinates exact multiples of it
+        if (!ParseFloat(&cl->options.grid,argv[i]) || cl->options.grid <= 0 || frexp(cl->options.grid,&exp) != 0.5)
+          throw "invalid grid size";
+      }
+      else if (strcmp(option,"k") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing cache directory";
+        CopyFileName(cl->cachedir,argv[i]);
+        cl->options.cacheDir = cl->cachedir;
+      }
+      else if (strcmp(option,"ks") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing cache size";
+        if (!ParseFloat(&cl->options.cacheSize,argv[i]) || cl->options.cacheSize < 0)
+          throw "invalid cache size";
+      }
+      else if (strcmp(option,"b") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing map list file";
+        CopyFileName(cl->listfn,argv[i]);
+      }
+      else if (strcmp(option,"bm") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing batch memory";
+        if (!ParseFloat(&cl->batchMemory,argv[i]) || cl->batchMemory <= 0)
+          throw "invalid batch memory";
+      }
+      else if (strcmp(option,"-serve") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing socket filename";
+        CopyFileName(cl->socketfn,argv[i]);
+      }
+      else if (strcmp(option,"sm") == 0)
+      {
+        i++;
+        if (argc <= i) throw "missing server cache memory";
+        if (!ParseFloat(&cl->serveMemory,argv[i]) || cl->serveMemory < 0)
+          throw "invalid server cache memory";
+      }
+      else if (strcmp(option,"j") == 0)
+      {
+        cl->flagThreads = 1;
+        cl->options.threads = thread::hardware_concurrency();
+
+        if (++i < argc && argv[i][0] != '-')
         {
-          i++;
-          if (argc <= i) throw "missing epsilon factor";
-          if (!ParseFloat(&efactor,argv[i]))
-            throw "invalid epsilon factor";
+          if (sscanf(argv[i],"%i",&cl->options.threads) != 1 || cl->options.threads < 1)
+            throw "invalid number of threads";
         }
-        else if (strcmp(option,"m") == 0)
-        {
-          i++;
+        else
+          --i;
+
+        if (cl->options.threads < 1)
+          cl->options.threads = 1;
+      }
+      else if (strcmp(option,"m") == 0)
+      {
+        i++;
 
-          if (argc <= i) throw "missing MAP version";
+        if (argc <= i) throw "missing MAP version";
 
-          if (strcmp(argv[i],"220") == 0)
-            map.MAPVersion = 220;
-          else if (strcmp(argv[i],"100") == 0)
-            map.MAPVersion = 100;
-          else throw "invalid MAP version";
+        if (strcmp(argv[i],"220") == 0)
+          cl->options.mapVersion = 220;
+        else if (strcmp(argv[i],"100") == 0)
+          cl->options.mapVersion = 100;
+        else throw "invalid MAP version";
+      }
+      else if (strcmp(option,"r") == 0)
+        cl->options.writeRMF = 1;
+      else if (strcmp(option,"v") == 0)
+        cl->options.visibleOnly = 1;
+      else if (strcmp(option,"nt") == 0)
+        cl->options.tesselate = 0;
+      else if (strcmp(option,"db") == 0)
+        cl->options.decomposeBSP = 1;
+      else if (strcmp(option,"dr") == 0)
+        cl->options.decomposeMemo = 1;
+      else if (strcmp(option,"dm") == 0)
+        cl->options.merge = 1;
+      else if (strcmp(option,"dc") == 0)
+        cl->options.decomposeCost = 1;
+      else if (strcmp(option,"nd") == 0)
+        cl->options.decompose = 0;
+      else if (strcmp(option,"nu") == 0)
+        cl->options.unite = 0;
+      else if (strcmp(option,"c") == 0)
+      {
+        flagCoincident = 1;
+
+        if (++i < argc && argv[i][0] != '-')
+        {
+          if (strlen(argv[i]) >= sizeof(cl->hiddentex))
+            throw "texture name too long";
+
+          strcpy(cl->hiddentex,argv[i]);
         }
-        else if (strcmp(option,"r") == 0)
-          flagWriteRMF = 1;
-        else if (strcmp(option,"v") == 0)
-          flagVisibleOnly = 1;
-        else if (strcmp(option,"nt") == 0)
-          flagTesselate = 0;
-        else if (strcmp(option,"nd") == 0)
-          flagDecompose = 0;
-        else if (strcmp(option,"nu") == 0)
-          flagUnite = 0;
-        else if (strcmp(option,"na") == 0)
-          flagTesselate = flagDecompose = flagUnite = 0;
-        else if (strcmp(option,"gd") == 0)
-          FlagGeoDebug = 1;
-        else if (strcmp(option,"rd") == 0)
-          FlagRMFDebug = 1;
         else
-          throw "invalid command line option";
+          --i;
       }
+      else if (strcmp(option,"nr") == 0)
+        cl->options.removeDegenerate = 0;
+      else if (strcmp(option,"na") == 0)
+        cl->options.project = cl->options.tesselate = cl->options.decompose = cl->options.unite = cl->options.removeDegenerate = 0;
+      else if (strcmp(option,"gd") == 0)
+        cl->options.debug = 1;
+      else if (strcmp(option,"gs") == 0)
+        cl->options.stats = 1;
+      else if (strcmp(option,"gb") == 0)
+        cl->options.benchmark = 1;
+      else if (strcmp(option,"rd") == 0)
+        cl->options.rmfDebug = 1;
       else
-        strcpy(rmffn,argv[i]);
+        throw "invalid command line option";
     }
+    else
+      CopyFileName(cl->rmffn,argv[i]);
+  }
 
-    if (rmffn[0] == '\0') throw "you must specify an input file";
+  if (flagCoincident)
+    cl->options.coincident = cl->hiddentex;
+}
 
-    if (strchr(rmffn,'.') == NULL)
-      strcat(rmffn,".rmf");
+int main(int argc, char **argv)
+{
+  FILE *fout, *frmf;
+  CommandLine cl;
+  HLFixOptions &options = cl.options;
+  HLFixError error;
+  HLFixStats stats;
+  HLFixMap *map;
+  vector<char> rmf;
+  vector<string> wads;
+  int i;
 
-    if (outfn[0] == '\0')
+  options.message = PrintMessage;
+
+  printf("hlfix v" HLFIX_VERSION " by Jedediah Smith - http://extension.ws/hlfix/\n");
+
+  try
+  {
+    ParseCommandLine(argc,argv,&cl);
+
+    if (cl.wadfn[0] == '\0')
     {
-      ParseFileName(rmffn,outfn);
-      strcat(outfn,flagWriteRMF ? ".rmf" : ".map");
+      strcpy(cl.wadfn,"wad.txt");
     }
 
-    if (wadfn[0] == '\0')
+    if (cl.listfn[0] != '\0' && cl.socketfn[0] != '\0')
+      throw "batch and server mode can't be used together";
+
+    if (cl.listfn[0] != '\0' || cl.socketfn[0] != '\0')
     {
-      strcpy(wadfn,"wad.txt");
+      if (cl.rmffn[0] != '\0' || cl.outfn[0] != '\0')
+        throw cl.listfn[0] != '\0' ? "input and output files are given in the map list file" : "input and output files are given in each request";
+
+      if (options.benchmark)
+        throw "maps can't be benchmarked in batch or server mode";
     }
+    else
+    {
+      if (cl.rmffn[0] == '\0') throw "you must specify an input file";
 
-    if (strcmp(rmffn,outfn) == 0)
-      throw "input file can't be the same as output file";
+      if (strchr(cl.rmffn,'.') == NULL)
+        AddExtension(cl.rmffn,".rmf");
+
+      if (cl.outfn[0] == '\0')
+      {
+        ParseFileName(cl.rmffn,cl.outfn);
+        AddExtension(cl.outfn,options.writeRMF ? ".rmf" : ".map");
+      }
+
+      if (strcmp(cl.rmffn,cl.outfn) == 0)
+        throw "input file can't be the same as output file";
+    }
   }
 
   catch (const char *msg)
@@ -255,141 +473,137 @@ int main(int argc, char **argv)
     printf("Command line error: %s\n",msg);
     printf(
       "Usage: hlfix <mapname>[.rmf] [options]\n"
+      "       hlfix -b <listfile> [options]\n"
+      "       hlfix --serve <socket> [-j threads] [-sm megabytes]\n"
       "  -o <outfile>           Output file (default is <mapname>.map or <mapname>.rmf)\n"
       "  -w [wadfile]           Use WAD list file (default is wad.txt)\n"
       "  -m <version>           MAP version to output (valid values are 220 or 100, default is 220)"
       "  -r                     Output to RMF file instead of MAP file\n"
+      "  -p <tolerance>         Project faces within tolerance of planar instead of tesselating them\n"
+      "  -s <grid>              Snap vertices to a power of two grid (e.g. 0.125) and write plane points on it\n"
+      "  -nr                    Don't remove duplicate and degenerate solids\n"
       "  -nt                    Don't tesselate non-planar faces\n"
       "  -nd                    Don't decompose non-convex solids\n"
+      "  -dc                    Choose decomposition cut planes with a cost model\n"
+      "  -db                    Decompose non-convex solids with a BSP tree\n"
+      "  -dm                    Merge decomposed pieces whose union is convex\n"
+      "  -dr                    Reuse the decomposition of identical solids at other positions\n"
       "  -nu                    Don't unite coplanar faces\n"
+      "  -c [texture]           Texture faces hidden by a coincident face (default is NULL)\n"
       "  -na                    Don't perform ANY geometry correction\n"
       "  -v                     Process and output visible objects only\n"
-      "  -e <number>            Epsilon factor for numeric comparisons (default is 1.0)\n");
+      "  -k <directory>         Reuse processed solids cached in directory by earlier runs\n"
+      "  -ks <megabytes>        Size the cache directory is kept within (default is 256)\n"
+      "  -j [threads]           Process solids on several threads, or in batch mode convert this many maps\n"
+      "                         at a time (default is one per processor)\n"
+      "  -b <listfile>          Convert the maps listed in listfile, one input and optional output per line\n"
+      "  -bm <megabytes>        Memory maps read ahead in batch mode are kept within (default is 1024)\n"
+      "  --serve <socket>       Convert maps requested on a Unix domain socket until stopped\n"
+      "  -sm <megabytes>        Memory the server keeps processed solids in between requests (default is 256)\n"
+      "  -e <number>            Epsilon factor for numeric comparisons (default is 1.0)\n"
+      "  -gs                    Print geometry pass statistics\n"
+      "  -gb                    Benchmark geometry kernels on the input file instead of converting it\n");
     return 1;
   }
 
-  GeoEpsilon = (double) efactor * 0.004;
+  if (cl.socketfn[0] != '\0')
+  {
+    if (!cl.flagThreads)
+      options.threads = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
 
-  printf("Using epsilon %lg\n",GeoEpsilon);
-  printf("Reading input file %s... ", rmffn);
-  fflush(stdout);
+    return RunServer(cl.socketfn,options.threads,(double) cl.serveMemory);
+  }
 
-  if ((frmf = fopen(rmffn,"rb")) == NULL)
+  printf("Using epsilon %lg\n",(double) options.epsilon * 0.004);
+
+  if (cl.listfn[0] != '\0')
   {
-    printf("can't open %s\n",rmffn);
-    return 1;
+    if (cl.flagWAD && !ReadWadList(cl.wadfn,&wads))
+      return 1;
+
+    if (!cl.flagThreads)
+      options.threads = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+
+    return RunBatch(cl.listfn,&options,wads,options.threads,(double) cl.batchMemory * 1048576);
   }
 
-  try
+  printf("Reading input file %s... ", cl.rmffn);
+  fflush(stdout);
+
+  if ((frmf = fopen(cl.rmffn,"rb")) == NULL)
   {
-    map.RMFRead(frmf);
-    fflush(stdout);
+    printf("can't open %s\n",cl.rmffn);
+    return 1;
   }
 
-  catch (GeoException *rmfe)
+  if (!ReadFile(frmf,&rmf))
   {
     fclose(frmf);
-    printf("error at offest %08xh: %s\n",map.RMFPos,rmfe->msg);
-    printf("Entity: %i\n", map.RMFPosEntity);
-    printf("Brush: %i\n", map.RMFPosSolid);
-    printf("Face: %i\n", map.RMFPosFace);
-    printf("Vector: %i\n", map.RMFPosVector);
-    printf("Key: %i\n", map.RMFPosKey);
-    printf("Path: %i\n", map.RMFPosPath);
-    printf("Corner: %i\n", map.RMFPosCorner);
-    printf("VisGroup: %i\n", map.RMFPosVisGroup);
+    printf("can't read %s\n",cl.rmffn);
     return 1;
   }
 
   fclose(frmf);
 
-  printf("done\n");
-  fflush(stdout);
-
-   if (flagWAD)
-   {
-    printf("Reading wad list file %s... ",wadfn);
-    fflush(stdout);
-
-    if ((fwad = fopen(wadfn,"r")) == NULL)
+  if ((map = HLFixLoad(rmf.empty() ? NULL : &rmf[0],rmf.size(),&options,&error)) == NULL)
+  {
+    if (error.code != HLFIX_ERROR_READ)
     {
-      printf("can't open %s\n",wadfn);
+      printf("%s\n",error.msg);
       return 1;
     }
 
-    while (fgets(wadfn,FILENAME_MAX+1,fwad) != NULL)
-    {
-      Chop(wadfn);
-      map.wads.push_back(string(wadfn));
-    }
-
-    fclose(fwad);
-    printf("done\n");
+    printf("error at offest %08xh: %s\n",error.offset,error.msg);
+    printf("Entity: %i\n", error.entity);
+    printf("Brush: %i\n", error.brush);
+    printf("Face: %i\n", error.face);
+    printf("Vector: %i\n", error.vector);
+    printf("Key: %i\n", error.key);
+    printf("Path: %i\n", error.path);
+    printf("Corner: %i\n", error.corner);
+    printf("VisGroup: %i\n", error.visgroup);
+    return 1;
   }
 
-  try
-  {
-    if (flagVisibleOnly)
-    {
-      printf("Pruning invisible objects\n");
-      PruneInvisibleObjects(&map,&map.visgroups);
-    }
-
-    printf("Snapping vertices\n");
-    SnapVertices(&map);
-
-    if (flagTesselate)
-    {
-      printf("Tesselating non-planar faces\n");
-      TesselateNonPlanarFaces(&map,&map);
-    }
+  printf("done\n");
+  fflush(stdout);
 
-    if (flagDecompose)
-    {
-      printf("Decomposing non-convex solids\n");
-      DecomposeGroup(&map);
-    }
+   if (cl.flagWAD)
+   {
+    if (!ReadWadList(cl.wadfn,&wads))
+      return 1;
 
-    if (flagUnite)
-    {
-      printf("Uniting coplanar faces\n");
-      UniteCoplanarFaces(&map);
-    }
+    for (i = 0; i < int(wads.size()); i++)
+      HLFixAddWad(map,wads[i].c_str());
   }
 
-  catch (GeoException *ex)
-  {
-    printf("  ERROR (Entity %i, Brush %i): %s\n",ex->entity, ex->brush, ex->msg);
-    delete ex;
-  }
+  if (HLFixProcess(map,&error) != HLFIX_OK)
+    PrintError(error);
+  else if (options.benchmark)
+    return 0;
 
-  printf("Writing output file %s... ",outfn);
+  printf("Writing output file %s... ",cl.outfn);
   fflush(stdout);
 
-  if ((fout = fopen(outfn,flagWriteRMF?"wb":"w")) == NULL)
+  if ((fout = fopen(cl.outfn,options.writeRMF?"wb":"w")) == NULL)
   {
-    printf("can't open %s\n",outfn);
+    printf("can't open %s\n",cl.outfn);
     return 1;
   }
 
-  try
-  {
-    if (flagWriteRMF)
-      map.RMFWrite(fout);
-    else
-      map.MAPWrite(fout);
-  }
-
-  catch (GeoException *ex)
-  {
-    printf("  ERROR (Entity %i, Brush %i): %s\n",ex->entity, ex->brush, ex->msg);
-    delete ex;
-  }
+  if (HLFixWrite(map,WriteFile,fout,&error) != HLFIX_OK)
+    PrintError(error);
 
   fclose(fout);
 
   printf("done\n");
 
+  HLFixGetStats(map,&stats);
+
+  if (options.stats && options.grid > 0 && !options.writeRMF)
+    printf("  %i of %i faces written with plane points on the grid\n",stats.ngridFaces,stats.nfaces);
+
+  HLFixFree(map);
+
   return 0;
 }
-
@@ -0,0 +1,57 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_MAIN
+#define _INC_MAIN
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "hlfix.h"
+
+using namespace std;
+
+// the command line of the program, or of a request to the server
+class CommandLine
+{
+  public:
+  HLFixOptions options; // its strings point into the buffers below
+  char wadfn[FILENAME_MAX+1];
+  char outfn[FILENAME_MAX+1];
+  char rmffn[FILENAME_MAX+1];
+  char hiddentex[256];
+  char cachedir[FILENAME_MAX+1];
+  char listfn[FILENAME_MAX+1];
+  char socketfn[FILENAME_MAX+1];
+  int flagWAD, flagThreads;
+  float batchMemory, serveMemory; // megabytes
+
+  CommandLine();
+};
+
+// parses the arguments after argv[0] into cl, throwing a message if one is invalid
+void ParseCommandLine(int argc, char **argv, CommandLine *cl);
+
+void ParseFileName(const char *pn, char *fn);
+
+// appends ext to a filename buffer FILENAME_MAX+1 long, throwing a message if it doesn't fit
+void AddExtension(char *fn, const char *ext);
+
+// reads the rest of f into buf, returning 0 if it couldn't be read
+int ReadFile(FILE *f, vector<char> *buf);
+
+// HLFixWriteFunc writing to the FILE data points to
+int WriteFile(const void *buf, size_t size, void *data);
+
+// reads the wads listed in fn, one per line, returning 0 if it can't be opened
+int ReadWadList(const char *fn, vector<string> *wads);
+
+#endif
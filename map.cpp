@@ -17,14 +17,72 @@ void GeoMap::MAPWriteKey(FILE *f, GeoKey *k)
   fprintf(f,"\"%s\" \"%s\"\n",k->name,k->value);
 }
 
+/*
+Looks for three vertices of the face which lie on the grid and define its plane with the same orientation as the
+last three vertices, taking the largest such triangle. Returns 0 if there are none
+*/
+
+int GridPlanePoints(GeoFace *face, GeoVector *p)
+{
+  list<GeoEdge>::reverse_iterator ire;
+  vector<GeoVector> verts;
+  GeoPlane plane;
+  GeoVector r, n;
+  double a, amax;
+  int i, j, k;
+
+  plane = face->plane();
+
+  for (ire = face->edges.rbegin(); ire != face->edges.rend() && verts.size() < 32; ire++)
+  {
+    r = GeoGridRound(ire->v1);
+
+    if (r == ire->v1 && r.isIn(plane))
+      verts.push_back(r);
+  }
+
+  amax = 0;
+
+  for (i = 0; i < int(verts.size()); i++)
+    for (j = i+1; j < int(verts.size()); j++)
+      for (k = j+1; k < int(verts.size()); k++)
+      {
+        n = (verts[j] - verts[i]) % (verts[k] - verts[i]);
+        a = -(n * plane.norm);
+
+        if (a > amax && a > GeoCurContext->epsilon)
+        {
+          amax = a;
+          p[0] = verts[i];
+          p[1] = verts[j];
+          p[2] = verts[k];
+        }
+      }
+
+  return amax > 0;
+}
+
 void GeoMap::MAPWriteFace(FILE *f, GeoFace *face)
 {
   list<GeoEdge>::reverse_iterator ire;
+  GeoVector p[3];
   int i;
   float uscale, vscale;
 
-  for (i = 0, ire = face->edges.rbegin(); i < 3; i++, ire++)
-    fprintf(f,"( %lg %lg %lg ) ",ire->v1.x,ire->v1.y,ire->v1.z);
+  ++MAPFaces;
+
+  if (GeoCurContext->gridSize > 0 && GridPlanePoints(face,p))
+  {
+    ++MAPGridFaces;
+
+    for (i = 0; i < 3; i++)
+      fprintf(f,"( %lg %lg %lg ) ",p[i].x,p[i].y,p[i].z);
+  }
+  else
+  {
+    for (i = 0, ire = face->edges.rbegin(); i < 3; i++, ire++)
+      fprintf(f,"( %lg %lg %lg ) ",ire->v1.x,ire->v1.y,ire->v1.z);
+  }
 
   if (MAPVersion == 220)
   {
@@ -77,7 +135,7 @@ void GeoMap::MAPWriteSolid(FILE *f, GeoSolid *solid)
 {
   list<GeoFace>::iterator iface;
 
-  GeoCurBrush = solid->index;
+  GeoCurContext->brush = solid->index;
 
   fprintf(f,"{\n");
 
@@ -104,7 +162,7 @@ void GeoMap::MAPWriteEntity(FILE *f, GeoEntity *entity)
 {
   list<GeoSolid>::iterator isolid;
 
-  GeoCurEntity = entity->index;
+  GeoCurContext->entity = entity->index;
 
   fprintf(f,"{\n");
 
@@ -259,6 +317,8 @@ void GeoMap::MAPWrite(FILE *f)
   list<GeoPath>::iterator ipath;
   int i;
 
+  MAPFaces = MAPGridFaces = 0;
+
   fprintf(f,"{\n\"mapversion\" \"220\"\n");
 
    if (!wads.empty())
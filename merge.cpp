@@ -0,0 +1,259 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
+#include "geo.h"
+#include "bsp.h"
+#include "merge.h"
+
+using namespace std;
+
+/*
+Two convex pieces P and Q lying either side of a shared plane H have a convex union exactly when every vertex of Q
+is behind or in every plane of P other than H, and every vertex of P is behind or in every plane of Q other than H.
+The union is then the intersection of those planes, so the merged solid is built directly from them, which also
+unites the faces that P and Q had in the same plane.
+*/
+
+class MergePiece
+{
+  public:
+  list<GeoSolid>::iterator solid;
+  vector<GeoPlane> planes;
+  vector<GeoVector> verts;
+  GeoVector lo, hi;
+};
+
+static int SamePlane(const GeoPlane &a, const GeoPlane &b)
+{
+  return a.norm == b.norm && fequal(a.d,b.d);
+}
+
+static void InitPiece(MergePiece *piece, list<GeoSolid>::iterator solid)
+{
+  list<GeoFace>::iterator iface;
+  list<GeoEdge>::iterator ie;
+
+  piece->solid = solid;
+  piece->planes.clear();
+  piece->verts.clear();
+  piece->lo = GeoVector(DBL_MAX,DBL_MAX,DBL_MAX);
+  piece->hi = GeoVector(-DBL_MAX,-DBL_MAX,-DBL_MAX);
+
+  foreach (iface, solid->faces)
+  {
+    piece->planes.push_back(iface->plane());
+
+    foreach (ie, iface->edges)
+    {
+      piece->verts.push_back(ie->v1);
+
+      piece->lo.x = min(piece->lo.x,ie->v1.x);
+      piece->lo.y = min(piece->lo.y,ie->v1.y);
+      piece->lo.z = min(piece->lo.z,ie->v1.z);
+      piece->hi.x = max(piece->hi.x,ie->v1.x);
+      piece->hi.y = max(piece->hi.y,ie->v1.y);
+      piece->hi.z = max(piece->hi.z,ie->v1.z);
+    }
+  }
+}
+
+// returns 1 if no vertex lies in front of any of the planes other than those in the shared plane
+static int AllBehind(const vector<GeoVector> &verts, const vector<GeoPlane> &planes, const GeoPlane &shared)
+{
+  int i, j;
+
+  for (i = 0; i < int(planes.size()); i++)
+  {
+    if (SamePlane(planes[i],shared))
+      continue;
+
+    for (j = 0; j < int(verts.size()); j++)
+      if (verts[j].sideOf(planes[i]) == SIDE_FRONT)
+        return 0;
+  }
+
+  return 1;
+}
+
+// returns 1 if the faces the two solids have in the same plane, other than the shared one, have the same texture
+static int SameTextures(GeoSolid &a, GeoSolid &b, const GeoPlane &shared)
+{
+  list<GeoFace>::iterator iface, jface;
+  GeoPlane plane;
+
+  foreach (iface, a.faces)
+  {
+    plane = iface->plane();
+
+    if (SamePlane(plane,shared))
+      continue;
+
+    foreach (jface, b.faces)
+      if (SamePlane(jface->plane(),plane) && jface->tex != iface->tex)
+        return 0;
+  }
+
+  return 1;
+}
+
+/*
+Tries to merge piece b into piece a. Returns 1 and replaces a's solid with the union if they share a face and
+the union is convex
+*/
+
+static int MergePair(MergePiece &a, MergePiece &b)
+{
+  vector<GeoPlane> planes;
+  GeoPlane shared, reversed;
+  GeoSolid faces, merged;
+  GeoVector lo, hi;
+  double eps = GeoCurContext->epsilon;
+  int i, j, found;
+
+  // pieces that don't touch can't share a face
+
+  if (a.lo.x > b.hi.x + eps || b.lo.x > a.hi.x + eps ||
+      a.lo.y > b.hi.y + eps || b.lo.y > a.hi.y + eps ||
+      a.lo.z > b.hi.z + eps || b.lo.z > a.hi.z + eps)
+    return 0;
+
+  found = 0;
+
+  for (i = 0; i < int(a.planes.size()) && !found; i++)
+  {
+    reversed = a.planes[i];
+    reversed.reverse();
+
+    for (j = 0; j < int(b.planes.size()) && !found; j++)
+      if (SamePlane(b.planes[j],reversed))
+      {
+        shared = a.planes[i];
+        found = 1;
+      }
+  }
+
+  if (!found)
+    return 0;
+
+  reversed = shared;
+  reversed.reverse();
+
+  if (!AllBehind(b.verts,a.planes,shared) || !AllBehind(a.verts,b.planes,reversed))
+    return 0;
+
+  if (!SameTextures(*a.solid,*b.solid,shared))
+    return 0;
+
+  for (i = 0; i < int(a.planes.size()); i++)
+    if (!SamePlane(a.planes[i],shared))
+      planes.push_back(a.planes[i]);
+
+  for (i = 0; i < int(b.planes.size()); i++)
+  {
+    if (SamePlane(b.planes[i],reversed))
+      continue;
+
+    for (j = 0; j < int(planes.size()); j++)
+      if (SamePlane(planes[j],b.planes[i]))
+        break;
+
+    if (j == int(planes.size()))
+      planes.push_back(b.planes[i]);
+  }
+
+  // textures are looked up in the faces of both pieces
+
+  faces = *a.solid;
+  faces.faces.insert(faces.faces.end(),b.solid->faces.begin(),b.solid->faces.end());
+
+  lo = GeoVector(min(a.lo.x,b.lo.x),min(a.lo.y,b.lo.y),min(a.lo.z,b.lo.z));
+  hi = GeoVector(max(a.hi.x,b.hi.x),max(a.hi.y,b.hi.y),max(a.hi.z,b.hi.z));
+
+  if (!BuildLeafSolid(faces,planes,(lo + hi) * 0.5,sqrt((hi - lo) * (hi - lo)) * 2 + 64,&merged))
+    return 0;
+
+  GeoDebugPrintf("  Merged two pieces of solid %i across plane [%lg %lg %lg %lg]\n",
+    a.solid->index,shared.norm.x,shared.norm.y,shared.norm.z,shared.d);
+
+  *a.solid = merged;
+  InitPiece(&a,a.solid);
+
+  return 1;
+}
+
+void MergeConvexPieces(list<GeoSolid> *solids, int *nbefore, int *nafter)
+{
+  map<int,vector<MergePiece> > pieces;
+  map<int,vector<MergePiece> >::iterator ip;
+  list<GeoSolid>::iterator isolid;
+  MergePiece piece;
+  int i, j, merged;
+
+  *nbefore += solids->size();
+
+  foreach (isolid, *solids)
+  {
+    InitPiece(&piece,isolid);
+    pieces[isolid->index].push_back(piece);
+  }
+
+  foreach (ip, pieces)
+  {
+    vector<MergePiece> &group = ip->second;
+
+    if (group.size() < 2)
+      continue;
+
+    GeoCurContext->brush = ip->first;
+
+    // merge until no pair of pieces can be merged
+
+    do
+    {
+      merged = 0;
+
+      for (i = 0; i < int(group.size()) && !merged; i++)
+        for (j = i + 1; j < int(group.size()) && !merged; j++)
+          if (MergePair(group[i],group[j]))
+          {
+            solids->erase(group[j].solid);
+            group.erase(group.begin() + j);
+            merged = 1;
+          }
+    }
+    while (merged);
+  }
+
+  *nafter += solids->size();
+}
+
+void MergeConvexPieces(GeoGroup *group, int *nbefore, int *nafter)
+{
+  list<GeoEntity>::iterator ientity;
+  list<GeoGroup>::iterator igroup;
+
+  GeoCurContext->entity = 0;
+  MergeConvexPieces(&group->solids,nbefore,nafter);
+
+  foreach (ientity, group->entities)
+  {
+    GeoCurContext->entity = ientity->index;
+    MergeConvexPieces(&ientity->solids,nbefore,nafter);
+  }
+
+  foreach (igroup, group->groups)
+    MergeConvexPieces(&*igroup,nbefore,nafter);
+}
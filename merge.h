@@ -0,0 +1,26 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_MERGE
+#define _INC_MERGE
+
+#include "geo.h"
+
+using namespace std;
+
+/*
+Run after decomposition. Greedily merges pairs of convex pieces of the same original solid which share a face
+and whose union is convex, adding the number of solids before and after to nbefore and nafter
+*/
+
+void MergeConvexPieces(GeoGroup *group, int *nbefore, int *nafter);
+
+#endif
@@ -0,0 +1,616 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <stdio.h>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "geo.h"
+#include "cd.h"
+#include "pred.h"
+#include "pool.h"
+
+using namespace std;
+
+/*
+The threads are started the first time they are needed and kept until the program exits. The thread that
+starts them takes part as thread 0, and any other thread runs the tasks it queues itself. Each thread has a queue of tasks it takes from the back of, and steals
+from the front of other threads' queues when its own is empty. A thread waiting for the tasks it queued to
+finish runs queued tasks meanwhile, so tasks can queue tasks of their own, and sleeps when there are none
+*/
+
+class WorkJob
+{
+  public:
+  void (*func)(int task, void *data);
+  void *data;
+  atomic<int> pending;
+  vector<string> logs;
+  vector<GeoContext> contexts;
+};
+
+class WorkTask
+{
+  public:
+  WorkJob *job;
+  int task;
+};
+
+class WorkQueue
+{
+  public:
+  mutex lock;
+  deque<WorkTask> tasks;
+};
+
+class WorkPool
+{
+  public:
+  vector<WorkQueue *> queues;
+  vector<thread> threads;
+  mutex lock;
+  condition_variable wake;
+  atomic<int> queued;
+  int started, shutdown;
+
+  WorkPool() : queued(0), started(0), shutdown(0) {}
+  ~WorkPool();
+};
+
+static WorkPool Pool;
+static mutex PoolStartLock;
+static thread_local int WorkerId = -1;
+
+static int TakeTask(WorkTask *task)
+{
+  int i, n;
+
+  n = Pool.queues.size();
+
+  for (i = 0; i < n; i++)
+  {
+    WorkQueue *queue = Pool.queues[(WorkerId + i) % n];
+    lock_guard<mutex> guard(queue->lock);
+
+    if (queue->tasks.empty())
+      continue;
+
+    if (i == 0)
+    {
+      *task = queue->tasks.back();
+      queue->tasks.pop_back();
+    }
+    else
+    {
+      *task = queue->tasks.front();
+      queue->tasks.pop_front();
+    }
+
+    --Pool.queued;
+    return 1;
+  }
+
+  return 0;
+}
+
+// runs the task in its copy of the context of the thread that queued it
+static void RunTask(WorkTask &task)
+{
+  WorkJob *job = task.job;
+
+  {
+    GeoContextScope scope(&job->contexts[task.task]);
+    job->func(task.task,job->data);
+
+    // anything the task made current must have been put back, or the context accessors would read the wrong one
+    assert(GeoCurContext == &job->contexts[task.task]);
+  }
+
+  // the thread that queued the job may be asleep waiting for it, and job is gone once it wakes
+
+  if (job->pending.fetch_sub(1,memory_order_acq_rel) == 1)
+  {
+    {
+      lock_guard<mutex> guard(Pool.lock);
+    }
+
+    Pool.wake.notify_all();
+  }
+}
+
+static void Worker(int id)
+{
+  WorkTask task;
+
+  WorkerId = id;
+
+  {
+    lock_guard<mutex> guard(Pool.lock);
+    Pool.started++;
+  }
+
+  Pool.wake.notify_all();
+
+  for (;;)
+  {
+    if (TakeTask(&task))
+    {
+      RunTask(task);
+      continue;
+    }
+
+    unique_lock<mutex> guard(Pool.lock);
+
+    while (Pool.queued == 0 && !Pool.shutdown)
+      Pool.wake.wait(guard);
+
+    if (Pool.shutdown)
+      break;
+  }
+}
+
+static void StartPool(void)
+{
+  int i;
+
+  WorkerId = 0;
+
+  for (i = 0; i < GeoCurContext->threads; i++)
+    Pool.queues.push_back(new WorkQueue);
+
+  Pool.started = 1;
+
+  for (i = 1; i < GeoCurContext->threads; i++)
+    Pool.threads.push_back(thread(Worker,i));
+
+  unique_lock<mutex> guard(Pool.lock);
+
+  while (Pool.started < GeoCurContext->threads)
+    Pool.wake.wait(guard);
+}
+
+WorkPool::~WorkPool()
+{
+  int i;
+
+  {
+    lock_guard<mutex> guard(lock);
+    shutdown = 1;
+  }
+
+  wake.notify_all();
+
+  for (i = 0; i < int(threads.size()); i++)
+    threads[i].join();
+
+  for (i = 0; i < int(queues.size()); i++)
+    delete queues[i];
+}
+
+void GeoParallelFor(int ntasks, void (*func)(int task, void *data), void *data)
+{
+  WorkJob job;
+  WorkTask task;
+  int i, entity, brush;
+
+  entity = GeoCurContext->entity;
+  brush = GeoCurContext->brush;
+
+  if (WorkerId < 0 && GeoCurContext->threads > 1)
+  {
+    lock_guard<mutex> guard(PoolStartLock);
+
+    if (Pool.queues.empty())
+      StartPool();
+  }
+
+  // a task on its own, or one queued by a thread outside the pool, is just run
+
+  if (ntasks == 1 || WorkerId < 0)
+  {
+    for (i = 0; i < ntasks; i++)
+    {
+      func(i,data);
+      GeoCurContext->entity = entity;
+      GeoCurContext->brush = brush;
+    }
+
+    return;
+  }
+
+  job.func = func;
+  job.data = data;
+  job.pending = ntasks;
+  job.logs.resize(ntasks);
+  job.contexts.assign(ntasks,*GeoCurContext);
+
+  for (i = 0; i < ntasks; i++)
+  {
+    job.contexts[i].messages = &job.logs[i];
+    job.contexts[i].decompose = DecomposeStats();
+    job.contexts[i].predicates = GeoPredicateStats();
+  }
+
+  task.job = &job;
+
+  /*
+  Queued in order, so that other threads steal the first tasks, which callers put the most expensive of, while this
+  thread works from the other end. Tasks queued by a task are taken by it before the rest
+  */
+
+  {
+    WorkQueue *queue = Pool.queues[WorkerId];
+    lock_guard<mutex> guard(queue->lock);
+
+    for (i = 0; i < ntasks; i++)
+    {
+      task.task = i;
+      queue->tasks.push_back(task);
+    }
+
+    Pool.queued += ntasks;
+  }
+
+  // a thread about to wait has checked queued under the pool lock, so taking it here ensures it is woken
+
+  {
+    lock_guard<mutex> guard(Pool.lock);
+  }
+
+  Pool.wake.notify_all();
+
+  while (job.pending.load(memory_order_acquire) > 0)
+  {
+    if (TakeTask(&task))
+    {
+      RunTask(task);
+      continue;
+    }
+
+    unique_lock<mutex> guard(Pool.lock);
+
+    while (job.pending.load(memory_order_acquire) > 0 && Pool.queued == 0)
+      Pool.wake.wait(guard);
+  }
+
+  for (i = 0; i < ntasks; i++)
+  {
+    GeoCurContext->decompose += job.contexts[i].decompose;
+    GeoCurContext->predicates += job.contexts[i].predicates;
+
+    GeoPrintString(job.logs[i].c_str());
+  }
+
+  fflush(stdout);
+}
+
+// how many chunks per thread the solids of a pass are grouped into
+#define CHUNKS_PER_THREAD 16
+
+// number of faces sampled for reflex edges by EstimateSolidCost()
+#define COST_SAMPLE_FACES 4
+
+double EstimateSolidCost(GeoSolid &solid, int sample)
+{
+  list<GeoFace>::iterator iface;
+  double cost;
+  int i, nfaces, nverts, nplanar, nsampled, nreflex, step;
+
+  nfaces = solid.faces.size();
+  nverts = nplanar = nsampled = nreflex = 0;
+  step = nfaces / COST_SAMPLE_FACES > 1 ? nfaces / COST_SAMPLE_FACES : 1;
+
+  for (iface = solid.faces.begin(), i = 0; iface != solid.faces.end(); ++iface, i++)
+  {
+    nverts += iface->edges.size();
+
+    if (!iface->isPlanar())
+      nplanar++;
+
+    if (sample && i % step == 0 && nsampled < COST_SAMPLE_FACES)
+    {
+      // a solid too broken to sample is left for the pass to report
+
+      try
+      {
+        nreflex += ReflexEdges(solid,iface);
+      }
+
+      catch (GeoException *ex)
+      {
+        delete ex;
+      }
+
+      nsampled++;
+    }
+  }
+
+  // testing convexity takes faces * vertices, and each cut repeats it for the pieces
+
+  cost = double(nfaces) * nverts + double(nplanar) * nverts;
+
+  if (nsampled > 0)
+    cost *= 1 + double(nreflex) * nfaces / nsampled;
+
+  return cost;
+}
+
+void EstimateSolidCosts(GeoGroup *group)
+{
+  list<GeoGroup>::iterator igroup;
+  list<GeoEntity>::iterator ientity;
+  list<GeoSolid>::iterator isolid;
+
+  foreach (igroup, group->groups)
+    EstimateSolidCosts(&*igroup);
+
+  foreach (ientity, group->entities)
+  {
+    GeoCurContext->entity = ientity->index;
+
+    foreach (isolid, ientity->solids)
+    {
+      GeoCurContext->brush = isolid->index;
+      isolid->cost = EstimateSolidCost(*isolid,1);
+    }
+  }
+
+  GeoCurContext->entity = 0;
+
+  foreach (isolid, group->solids)
+  {
+    GeoCurContext->brush = isolid->index;
+    isolid->cost = EstimateSolidCost(*isolid,1);
+  }
+}
+
+class SolidTask
+{
+  public:
+  list<GeoSolid> *owner;
+  list<GeoSolid> solids;
+  int entity, brush;
+  double cost, time;
+  string log;
+  GeoException *error;
+};
+
+class SolidPass
+{
+  public:
+  vector<SolidTask> tasks;
+  vector<vector<int> > chunks;
+  void (*pass)(list<GeoSolid> *solids);
+};
+
+// moves each solid into a task of its own, leaving the list empty until the results are moved back
+static void AddSolidTasks(list<GeoSolid> *solids, int entity, SolidPass *pass)
+{
+  SolidTask task;
+
+  task.owner = solids;
+  task.entity = entity;
+  task.time = 0;
+  task.error = NULL;
+
+  while (!solids->empty())
+  {
+    // solids made by earlier passes have no estimate from loading, and are cheap enough not to sample
+    task.brush = solids->front().index;
+    task.cost = solids->front().cost > 0 ? solids->front().cost : EstimateSolidCost(solids->front(),0);
+
+    pass->tasks.push_back(task);
+    pass->tasks.back().solids.splice(pass->tasks.back().solids.end(),*solids,solids->begin());
+  }
+}
+
+// in the same order as DecomposeGroup()
+static void AddSolidTasks(GeoGroup *group, SolidPass *pass)
+{
+  list<GeoEntity>::iterator ientity;
+  list<GeoGroup>::iterator igroup;
+
+  AddSolidTasks(&group->solids,0,pass);
+
+  foreach (ientity, group->entities)
+    AddSolidTasks(&ientity->solids,ientity->index,pass);
+
+  foreach (igroup, group->groups)
+    AddSolidTasks(&*igroup,pass);
+}
+
+class SolidTaskCost
+{
+  public:
+  vector<SolidTask> *tasks;
+
+  SolidTaskCost(vector<SolidTask> *t) : tasks(t) {}
+
+  bool operator()(int a, int b) const
+  {
+    return (*tasks)[a].cost > (*tasks)[b].cost;
+  }
+};
+
+/*
+Groups the tasks into chunks, most expensive first. A task costing more than a thread's share divided by
+CHUNKS_PER_THREAD is a chunk of its own, and smaller ones are added to a chunk until it costs that much
+*/
+
+static void ChunkSolidTasks(SolidPass *pass)
+{
+  vector<int> order;
+  double total, target, cost;
+  int i;
+
+  total = 0;
+
+  for (i = 0; i < int(pass->tasks.size()); i++)
+  {
+    order.push_back(i);
+    total += pass->tasks[i].cost;
+  }
+
+  stable_sort(order.begin(),order.end(),SolidTaskCost(&pass->tasks));
+
+  target = total / ((GeoCurContext->threads > 1 ? GeoCurContext->threads : 1) * CHUNKS_PER_THREAD);
+  cost = target;
+
+  for (i = 0; i < int(order.size()); i++)
+  {
+    if (cost >= target)
+    {
+      pass->chunks.push_back(vector<int>());
+      cost = 0;
+    }
+
+    pass->chunks.back().push_back(order[i]);
+    cost += pass->tasks[order[i]].cost;
+  }
+}
+
+static void RunSolidChunk(int i, void *data)
+{
+  SolidPass *pass = (SolidPass *)data;
+  chrono::steady_clock::time_point start;
+  string *buffer;
+  int j;
+
+  buffer = GeoCurContext->messages;
+
+  for (j = 0; j < int(pass->chunks[i].size()); j++)
+  {
+    SolidTask &task = pass->tasks[pass->chunks[i][j]];
+
+    GeoCurContext->entity = task.entity;
+    GeoCurContext->brush = task.brush;
+    GeoCurContext->messages = &task.log;
+    start = chrono::steady_clock::now();
+
+    try
+    {
+      pass->pass(&task.solids);
+    }
+
+    catch (GeoException *ex)
+    {
+      task.error = ex;
+    }
+
+    task.time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  GeoCurContext->messages = buffer;
+}
+
+class SolidTaskTime
+{
+  public:
+  vector<SolidTask> *tasks;
+
+  SolidTaskTime(vector<SolidTask> *t) : tasks(t) {}
+
+  bool operator()(int a, int b) const
+  {
+    return (*tasks)[a].time > (*tasks)[b].time;
+  }
+};
+
+// compares the estimated cost of each solid with the time it took, to tune EstimateSolidCost()
+static void PrintScheduleStats(SolidPass *pass)
+{
+  vector<int> bycost, bytime, rank;
+  double sx, sy, sxx, syy, sxy, n, r;
+  int i;
+
+  sx = sy = sxx = syy = sxy = 0;
+  n = pass->tasks.size();
+
+  for (i = 0; i < int(pass->tasks.size()); i++)
+  {
+    SolidTask &task = pass->tasks[i];
+
+    sx += task.cost;
+    sy += task.time;
+    sxx += task.cost * task.cost;
+    syy += task.time * task.time;
+    sxy += task.cost * task.time;
+    bycost.push_back(i);
+  }
+
+  if (n == 0)
+    return;
+
+  r = n * sxx - sx * sx > 0 && n * syy - sy * sy > 0 ? (n * sxy - sx * sy) / sqrt((n * sxx - sx * sx) * (n * syy - sy * sy)) : 0;
+
+  GeoPrintf("  %i solids scheduled in %i chunks, estimated cost %.0lf, time %.3lfs, correlation %.3lf, %.4lfus per unit\n",
+    int(n), int(pass->chunks.size()), sx, sy, r, sxx > 0 ? sxy / sxx * 1e6 : 0);
+
+  // the solids which took longest, with their rank by estimated cost
+
+  stable_sort(bycost.begin(),bycost.end(),SolidTaskCost(&pass->tasks));
+  bytime = bycost;
+  stable_sort(bytime.begin(),bytime.end(),SolidTaskTime(&pass->tasks));
+  rank.resize(bycost.size());
+
+  for (i = 0; i < int(bycost.size()); i++)
+    rank[bycost[i]] = i + 1;
+
+  for (i = 0; i < int(bytime.size()) && i < 5; i++)
+  {
+    SolidTask &task = pass->tasks[bytime[i]];
+
+    GeoPrintf("    (Entity %i, Brush %i): estimated cost %.0lf (rank %i), time %.3lfms\n",
+      task.entity, task.brush, task.cost, rank[bytime[i]], task.time * 1000);
+  }
+}
+
+void ParallelSolidPass(GeoGroup *group, void (*pass)(list<GeoSolid> *solids))
+{
+  SolidPass solids;
+  GeoException *error = NULL;
+  int i;
+
+  solids.pass = pass;
+  AddSolidTasks(group,&solids);
+  ChunkSolidTasks(&solids);
+
+  GeoParallelFor(solids.chunks.size(),RunSolidChunk,&solids);
+
+  for (i = 0; i < int(solids.tasks.size()); i++)
+  {
+    SolidTask &task = solids.tasks[i];
+
+    GeoPrintString(task.log.c_str());
+
+    task.owner->splice(task.owner->end(),task.solids);
+
+    if (error == NULL)
+      error = task.error;
+    else
+      delete task.error;
+  }
+
+  fflush(stdout);
+
+  if (GeoCurContext->flagStats)
+    PrintScheduleStats(&solids);
+
+  if (error != NULL)
+    throw error;
+}
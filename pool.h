@@ -0,0 +1,49 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_POOL
+#define _INC_POOL
+
+#include <list>
+#include "geo.h"
+
+using namespace std;
+
+/*
+Runs func(task, data) for every task from 0 to ntasks - 1 on the threads of the current context and waits for them
+to finish. Tasks may call GeoParallelFor() themselves. Each task runs in a copy of the caller's context, and its
+messages and counters are passed on to the caller in task order once all are done. func must catch its own exceptions
+*/
+
+void GeoParallelFor(int ntasks, void (*func)(int task, void *data), void *data);
+
+/*
+Runs a pass over every solid in the group in parallel. Each solid is passed to the pass in a list of its own,
+which the pass may replace with any number of solids. When all are done the results replace the solids in the
+order they were in and messages are printed in that order too, so the output doesn't depend on the number of
+threads. Every solid is processed even if the pass throws a GeoException for one of them, and the first such
+exception in order is rethrown. Solids are run most expensive first, small ones grouped into chunks of similar
+cost. With flagStats set the estimated cost of each solid is compared with the time it took
+*/
+
+void ParallelSolidPass(GeoGroup *group, void (*pass)(list<GeoSolid> *solids));
+
+/*
+Estimates the relative cost of processing a solid from its faces, vertices and non-planar faces, scaled by the
+number of reflex edges found on a sample of its faces if sample is set
+*/
+
+double EstimateSolidCost(GeoSolid &solid, int sample);
+
+// stores the estimated cost of every solid in the group
+void EstimateSolidCosts(GeoGroup *group);
+
+#endif
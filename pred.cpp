@@ -0,0 +1,255 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include "geo.h"
+#include "pred.h"
+
+using namespace std;
+
+/*
+The exact arithmetic follows Shewchuk, "Adaptive Precision Floating-Point Arithmetic and Fast Robust Geometric
+Predicates". A number is held as an expansion: a sum of doubles which don't overlap, smallest magnitude first, so
+that the sign of the whole sum is the sign of its last component. These routines rely on every operation being
+rounded to double, which holds for SSE2 math but not for x87 extended precision or contracted multiply-adds.
+*/
+
+// x + y == a + b exactly
+static inline void TwoSum(double a, double b, double &x, double &y)
+{
+  double av, bv;
+
+  x = a + b;
+  bv = x - a;
+  av = x - bv;
+  y = (a - av) + (b - bv);
+}
+
+// x + y == a - b exactly
+static inline void TwoDiff(double a, double b, double &x, double &y)
+{
+  double av, bv;
+
+  x = a - b;
+  bv = a - x;
+  av = x + bv;
+  y = (a - av) + (bv - b);
+}
+
+// hi + lo == a, with hi and lo having at most 26 significant bits each
+static inline void Split(double a, double &hi, double &lo)
+{
+  double c;
+
+  c = 134217729.0 * a; // 2^27 + 1
+  hi = c - (c - a);
+  lo = a - hi;
+}
+
+// x + y == a * b exactly
+static inline void TwoProduct(double a, double b, double &x, double &y)
+{
+  double ahi, alo, bhi, blo;
+
+  x = a * b;
+  Split(a,ahi,alo);
+  Split(b,bhi,blo);
+  y = alo * blo - (((x - ahi * bhi) - alo * bhi) - ahi * blo);
+}
+
+class GeoExpansion
+{
+  public:
+  vector<double> c;
+
+  GeoExpansion() {}
+
+  GeoExpansion(double a)
+  {
+    if (a != 0)
+      c.push_back(a);
+  }
+
+  // exact difference of two doubles
+  GeoExpansion(double a, double b)
+  {
+    double x, y;
+
+    TwoDiff(a,b,x,y);
+
+    if (y != 0)
+      c.push_back(y);
+
+    if (x != 0)
+      c.push_back(x);
+  }
+
+  // adds a to the expansion, dropping zero components
+  void grow(double a)
+  {
+    vector<double> h;
+    double q, x;
+    int i;
+
+    q = a;
+
+    for (i = 0; i < int(c.size()); i++)
+    {
+      TwoSum(q,c[i],q,x);
+
+      if (x != 0)
+        h.push_back(x);
+    }
+
+    if (q != 0)
+      h.push_back(q);
+
+    c.swap(h);
+  }
+
+  GeoExpansion operator+(const GeoExpansion &e) const
+  {
+    GeoExpansion r = *this;
+    int i;
+
+    for (i = 0; i < int(e.c.size()); i++)
+      r.grow(e.c[i]);
+
+    return r;
+  }
+
+  GeoExpansion operator-(void) const
+  {
+    GeoExpansion r = *this;
+    int i;
+
+    for (i = 0; i < int(r.c.size()); i++)
+      r.c[i] = -r.c[i];
+
+    return r;
+  }
+
+  GeoExpansion operator-(const GeoExpansion &e) const
+  {
+    return *this + -e;
+  }
+
+  GeoExpansion operator*(const GeoExpansion &e) const
+  {
+    GeoExpansion r;
+    double x, y;
+    int i, j;
+
+    for (i = 0; i < int(c.size()); i++)
+      for (j = 0; j < int(e.c.size()); j++)
+      {
+        TwoProduct(c[i],e.c[j],x,y);
+        r.grow(y);
+        r.grow(x);
+      }
+
+    return r;
+  }
+
+  int sign(void) const
+  {
+    if (c.empty())
+      return 0;
+
+    return c.back() > 0 ? 1 : -1;
+  }
+};
+
+static int Sign(double d)
+{
+  return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+int GeoOrient2D(double ax, double ay, double bx, double by, double cx, double cy)
+{
+  double l, r, det, bound;
+
+  l = (bx - ax) * (cy - ay);
+  r = (by - ay) * (cx - ax);
+  det = l - r;
+  bound = 4 * DBL_EPSILON * (fabs(l) + fabs(r));
+
+  // the sign of each product is exact, so det has the right sign whenever they don't share one, as when points
+  // line up along an axis
+
+  if (det > bound || -det > bound || (l <= 0 && r >= 0) || (l >= 0 && r <= 0))
+  {
+    ++GeoCurContext->predicates.nfiltered;
+    return Sign(det);
+  }
+
+  ++GeoCurContext->predicates.nexact;
+
+  return (GeoExpansion(bx,ax) * GeoExpansion(cy,ay) - GeoExpansion(by,ay) * GeoExpansion(cx,ax)).sign();
+}
+
+int GeoTripleSign(const GeoVector &a1, const GeoVector &a2, const GeoVector &b1, const GeoVector &b2, const GeoVector &c1, const GeoVector &c2)
+{
+  GeoVector a, b, c;
+  double det, perm;
+
+  a = a2 - a1;
+  b = b2 - b1;
+  c = c2 - c1;
+
+  det = (a % b) * c;
+  perm =
+    (fabs(a.y * b.z) + fabs(a.z * b.y)) * fabs(c.x) +
+    (fabs(a.z * b.x) + fabs(a.x * b.z)) * fabs(c.y) +
+    (fabs(a.x * b.y) + fabs(a.y * b.x)) * fabs(c.z);
+
+  // with every product zero, which is common for axis aligned vectors, det is exactly zero
+
+  if (det > 8 * DBL_EPSILON * perm || -det > 8 * DBL_EPSILON * perm || perm == 0)
+  {
+    ++GeoCurContext->predicates.nfiltered;
+    return Sign(det);
+  }
+
+  ++GeoCurContext->predicates.nexact;
+
+  GeoExpansion ax(a2.x,a1.x), ay(a2.y,a1.y), az(a2.z,a1.z);
+  GeoExpansion bx(b2.x,b1.x), by(b2.y,b1.y), bz(b2.z,b1.z);
+  GeoExpansion cx(c2.x,c1.x), cy(c2.y,c1.y), cz(c2.z,c1.z);
+
+  return (
+    (ay * bz - az * by) * cx +
+    (az * bx - ax * bz) * cy +
+    (ax * by - ay * bx) * cz).sign();
+}
+
+int GeoTripleSign(const GeoVector &a, const GeoVector &b, const GeoVector &c)
+{
+  GeoVector zero(0,0,0);
+
+  return GeoTripleSign(zero,a,zero,b,zero,c);
+}
+
+int GeoOrient3D(const GeoVector &a, const GeoVector &b, const GeoVector &c, const GeoVector &d)
+{
+  return GeoTripleSign(a,b,a,c,a,d);
+}
+
+int GeoColinear(const GeoVector &a, const GeoVector &b, const GeoVector &c)
+{
+  // (b-a) % (c-a) is zero exactly when its projection onto each coordinate plane is
+
+  return
+    GeoOrient2D(a.y,a.z,b.y,b.z,c.y,c.z) == 0 &&
+    GeoOrient2D(a.z,a.x,b.z,b.x,c.z,c.x) == 0 &&
+    GeoOrient2D(a.x,a.y,b.x,b.y,c.x,c.y) == 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_PRED
+#define _INC_PRED
+
+/*
+Sign-only geometric predicates. Each is first evaluated in ordinary floating point together with a bound on its
+rounding error, and only if the result is within that bound is it evaluated again exactly with floating point
+expansions. The answers are therefore always the exact sign of the expression for the given inputs, with no
+epsilon involved, so two tests of the same configuration can never disagree.
+*/
+
+class GeoVector;
+
+// sign of (b-a) x (c-a), i.e. 1 if a, b, c turn counterclockwise, -1 if clockwise, 0 if they are colinear
+int GeoOrient2D(double ax, double ay, double bx, double by, double cx, double cy);
+
+// sign of ((a2-a1) % (b2-b1)) * (c2-c1)
+int GeoTripleSign(const GeoVector &a1, const GeoVector &a2, const GeoVector &b1, const GeoVector &b2, const GeoVector &c1, const GeoVector &c2);
+
+// sign of (a % b) * c
+int GeoTripleSign(const GeoVector &a, const GeoVector &b, const GeoVector &c);
+
+// sign of ((b-a) % (c-a)) * (d-a), i.e. 1 if d lies on the side of the plane through a, b, c that they turn counterclockwise seen from
+int GeoOrient3D(const GeoVector &a, const GeoVector &b, const GeoVector &c, const GeoVector &d);
+
+// returns 1 if a, b and c lie exactly on one line, including when any two of them are the same point
+int GeoColinear(const GeoVector &a, const GeoVector &b, const GeoVector &c);
+
+class GeoPredicateStats
+{
+  public:
+  int nfiltered; // answered by the floating point filter
+  int nexact; // needed the exact fallback
+
+  GeoPredicateStats() : nfiltered(0), nexact(0) {}
+
+  GeoPredicateStats &operator+=(const GeoPredicateStats &s)
+  {
+    nfiltered += s.nfiltered;
+    nexact += s.nexact;
+    return *this;
+  }
+};
+
+#endif
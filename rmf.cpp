@@ -14,18 +14,18 @@
 
 using namespace std;
 
-int FlagRMFDebug;
-
 void RMFDebugPrintf(const char *str,...)
 {
-  if (!FlagRMFDebug)
+  if (!GeoCurContext->flagRMFDebug)
     return;
 
+  char buf[1024];
   va_list args;
 
   va_start(args,str);
-  vprintf(str,args);
+  vsnprintf(buf,sizeof(buf),str,args);
   va_end(args);
+  GeoPrintString(buf);
   fflush(stdout);
 }
 
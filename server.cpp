@@ -0,0 +1,726 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "hlfix.h"
+#include "main.h"
+#include "server.h"
+
+using namespace std;
+
+// longest request line accepted, and largest inline input
+#define SERVE_MAX_LINE 65536
+#define SERVE_MAX_INPUT (1024 * 1048576ULL)
+
+class ServeConnection
+{
+  public:
+  int fd;
+  char buf[65536];
+  int pos, len;
+  int broken; // set once sending fails, after which nothing more is sent
+
+  ServeConnection(int tfd) : fd(tfd), pos(0), len(0), broken(0) {}
+
+  int readLine(string *line);
+  int readBytes(vector<char> *data, size_t n);
+  void send(const void *data, size_t n);
+
+  private:
+  int fill(void);
+};
+
+/*
+The conversion thread only adds the answer of a request to reply, which the thread of its connection sends, so a
+client that reads slowly holds up nobody but itself
+*/
+
+class ServeRequest
+{
+  public:
+  ServeConnection *conn;
+  CommandLine cl;
+  int flagInline;
+  vector<char> rmf;
+  HLFixError error;
+  double readTime;
+  mutex lock; // guards the fields below
+  condition_variable ready;
+  string reply; // answer not sent yet
+  int done, broken;
+
+  ServeRequest(ServeConnection *tconn) : conn(tconn), flagInline(0), readTime(0), done(0), broken(0)
+  {
+    memset(&error,0,sizeof(error));
+  }
+
+  int post(const char *kind, const void *data, size_t n);
+  int post(const string &text);
+};
+
+class Server
+{
+  public:
+  HLFixCache *cache;
+  int threads, nrequests;
+  deque<ServeRequest *> queue;
+  mutex lock;
+  condition_variable wake;
+};
+
+static char ServeSocket[FILENAME_MAX+1];
+static char ServeRoot[PATH_MAX]; // the directory the server was started in, with links resolved
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int ServeConnection::fill(void)
+{
+  int n;
+
+  if (pos == len)
+    pos = len = 0;
+
+  do
+    n = recv(fd,buf + len,sizeof(buf) - len,0);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0)
+    return 0;
+
+  len += n;
+  return 1;
+}
+
+// reads a line without its end, returning 0 at the end of the connection and -1 if the line is too long
+int ServeConnection::readLine(string *line)
+{
+  char *end;
+
+  line->clear();
+
+  for (;;)
+  {
+    if ((end = (char *)memchr(buf + pos,'\n',len - pos)) != NULL)
+    {
+      line->append(buf + pos,end);
+      pos = end + 1 - buf;
+
+      if (!line->empty() && (*line)[line->size()-1] == '\r')
+        line->erase(line->size()-1);
+
+      return 1;
+    }
+
+    line->append(buf + pos,buf + len);
+    pos = len;
+
+    if (line->size() > SERVE_MAX_LINE)
+      return -1;
+
+    if (!fill())
+      return 0;
+  }
+}
+
+int ServeConnection::readBytes(vector<char> *data, size_t n)
+{
+  size_t m;
+
+  // the buffer grows with what arrives rather than by the size the client claims
+
+  data->clear();
+
+  while (data->size() < n)
+  {
+    if (pos == len && !fill())
+      return 0;
+
+    m = n - data->size() < size_t(len - pos) ? n - data->size() : size_t(len - pos);
+    data->insert(data->end(),buf + pos,buf + pos + m);
+    pos += m;
+  }
+
+  return 1;
+}
+
+void ServeConnection::send(const void *data, size_t n)
+{
+  const char *p = (const char *)data;
+  ssize_t m;
+
+  while (n > 0 && !broken)
+  {
+    m = ::send(fd,p,n,MSG_NOSIGNAL);
+
+    if (m < 0 && errno == EINTR)
+      continue;
+
+    if (m <= 0)
+    {
+      broken = 1;
+      return;
+    }
+
+    p += m;
+    n -= m;
+  }
+}
+
+static void AppendF(string *out, const char *format, ...)
+{
+  char line[2048];
+  va_list args;
+  int n;
+
+  va_start(args,format);
+  n = vsnprintf(line,sizeof(line),format,args);
+  va_end(args);
+
+  out->append(line,n < int(sizeof(line)) ? n : sizeof(line) - 1);
+}
+
+// adds a block to the reply, returning 0 once the client is gone, after which nothing more is kept
+int ServeRequest::post(const char *kind, const void *data, size_t n)
+{
+  lock_guard<mutex> guard(lock);
+
+  if (broken)
+    return 0;
+
+  AppendF(&reply,"%s %lu\n",kind,(unsigned long) n);
+  reply.append((const char *)data,n);
+  ready.notify_all();
+  return 1;
+}
+
+int ServeRequest::post(const string &text)
+{
+  lock_guard<mutex> guard(lock);
+
+  if (broken)
+    return 0;
+
+  reply += text;
+  ready.notify_all();
+  return 1;
+}
+
+static void SendMessage(const char *str, void *data)
+{
+  ((ServeRequest *)data)->post("log",str,strlen(str));
+}
+
+static int SendOutput(const void *buf, size_t size, void *data)
+{
+  return ((ServeRequest *)data)->post("output",buf,size);
+}
+
+static void FormatResult(string *out, const HLFixError &error, const HLFixStats &stats, const double *times)
+{
+  if (error.code != HLFIX_OK)
+    AppendF(out,"error %i %i %i %i %s\n",error.code,error.entity,error.brush,error.offset,error.msg);
+
+  AppendF(out,"done %i %i %i %i %.3lf %.3lf %.3lf %.3lf\n",error.code,stats.nsolidsRead,stats.nsolidsProcessed,
+    stats.nsolidsCached,times[0],times[1],times[2],times[3]);
+}
+
+static void SetServeError(HLFixError *error, int code, const char *msg, const char *fn)
+{
+  string text;
+
+  // a long filename is cut short like any message too long for the error
+  text = string(msg) + fn;
+  error->code = code;
+  strncpy(error->msg,text.c_str(),sizeof(error->msg)-1);
+  error->msg[sizeof(error->msg)-1] = '\0';
+}
+
+// splits a request into arguments, separated by spaces or tabs unless they are quoted
+static void SplitRequest(const string &line, vector<string> *args)
+{
+  unsigned int i;
+  int quoted;
+
+  args->clear();
+
+  for (i = 0; i < line.size();)
+  {
+    if (line[i] == ' ' || line[i] == '\t')
+    {
+      i++;
+      continue;
+    }
+
+    args->push_back(string());
+    quoted = 0;
+
+    for (; i < line.size() && (quoted || (line[i] != ' ' && line[i] != '\t')); i++)
+    {
+      if (line[i] == '"')
+        quoted = !quoted;
+      else
+        args->back() += line[i];
+    }
+  }
+}
+
+/*
+Returns 1 if fn is a relative path without ".." that stays in ServeRoot. Links are followed as far as fn exists, so
+they can't lead out of it either, and a file still to be created is checked by its directory
+*/
+
+static int InServeRoot(const char *fn)
+{
+  char resolved[PATH_MAX];
+  string path, dir;
+  size_t i, j, n;
+
+  path = fn;
+
+  if (path.empty() || path[0] == '/')
+    return 0;
+
+  for (i = 0; i <= path.size(); i = j + 1)
+  {
+    if ((j = path.find('/',i)) == string::npos)
+      j = path.size();
+
+    if (path.compare(i,j - i,"..") == 0)
+      return 0;
+  }
+
+  if (realpath(fn,resolved) == NULL)
+  {
+    dir = path.find('/') == string::npos ? string(".") : path.substr(0,path.rfind('/'));
+
+    if (realpath(dir.c_str(),resolved) == NULL)
+      return 0;
+  }
+
+  n = strlen(ServeRoot);
+
+  return strncmp(resolved,ServeRoot,n) == 0 && (n == 1 || resolved[n] == '\0' || resolved[n] == '/');
+}
+
+/*
+Parses a request and reads its input, returning 0 if it is invalid and -1 if the connection can't be read from
+in step with the client any more. error is set unless 1 is returned
+*/
+
+static int ReadRequest(const string &line, ServeRequest *r)
+{
+  chrono::steady_clock::time_point start;
+  vector<string> args;
+  vector<char *> argv;
+  unsigned long long size;
+  unsigned int i;
+  FILE *f;
+  int ok;
+
+  SplitRequest(line,&args);
+
+  // inline input is read first, so that the connection stays in step even if the rest is invalid
+
+  for (i = 0; i < args.size(); i++)
+    if (args[i] == "-i")
+    {
+      if (i + 1 == args.size() || args[i+1].empty() || args[i+1].find_first_not_of("0123456789") != string::npos)
+      {
+        SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"invalid inline input size","");
+        return -1;
+      }
+
+      size = strtoull(args[i+1].c_str(),NULL,10);
+
+      if (size > SERVE_MAX_INPUT)
+      {
+        SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"inline input too large","");
+        return -1;
+      }
+
+      start = chrono::steady_clock::now();
+
+      if (!r->conn->readBytes(&r->rmf,size))
+      {
+        SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"connection closed during inline input","");
+        return -1;
+      }
+
+      r->readTime = Seconds(start);
+      r->flagInline = 1;
+      args.erase(args.begin() + i,args.begin() + i + 2);
+      break;
+    }
+
+  argv.push_back((char *)"hlfix");
+
+  for (i = 0; i < args.size(); i++)
+    argv.push_back(&args[i][0]);
+
+  try
+  {
+    // a request can be far longer than the filename buffers it is parsed into
+
+    for (i = 0; i < args.size(); i++)
+      if (args[i].size() > FILENAME_MAX)
+        throw "filename too long";
+
+    ParseCommandLine(argv.size(),&argv[0],&r->cl);
+
+    if (r->cl.listfn[0] != '\0' || r->cl.socketfn[0] != '\0' || r->cl.flagThreads || r->cl.options.benchmark)
+      throw "-j, -b, -gb and --serve can't be given in a request";
+
+    if (r->flagInline && r->cl.rmffn[0] != '\0')
+      throw "input file given with inline input";
+
+    if (!r->flagInline && r->cl.rmffn[0] == '\0')
+      throw "missing input file";
+
+    if (!r->flagInline && strchr(r->cl.rmffn,'.') == NULL)
+      AddExtension(r->cl.rmffn,".rmf");
+
+    if (!r->flagInline && strcmp(r->cl.rmffn,r->cl.outfn) == 0)
+      throw "input file can't be the same as output file";
+
+    if (r->cl.wadfn[0] == '\0')
+      strcpy(r->cl.wadfn,"wad.txt");
+
+    // whoever can connect can only name files under the server's directory
+
+    if ((!r->flagInline && !InServeRoot(r->cl.rmffn)) || (r->cl.outfn[0] != '\0' && !InServeRoot(r->cl.outfn)) ||
+      (r->cl.flagWAD && !InServeRoot(r->cl.wadfn)) || (r->cl.options.cacheDir != NULL && !InServeRoot(r->cl.cachedir)))
+      throw "files must be given by relative paths within the server's directory";
+  }
+
+  catch (const char *msg)
+  {
+    SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,msg,"");
+    return 0;
+  }
+
+  if (r->flagInline)
+    return 1;
+
+  start = chrono::steady_clock::now();
+
+  if ((f = fopen(r->cl.rmffn,"rb")) == NULL)
+  {
+    SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"can't open ",r->cl.rmffn);
+    return 0;
+  }
+
+  ok = ReadFile(f,&r->rmf);
+  fclose(f);
+  r->readTime = Seconds(start);
+
+  if (!ok)
+  {
+    SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"can't read ",r->cl.rmffn);
+    return 0;
+  }
+
+  return 1;
+}
+
+// answers a request and prints a summary of it
+static void FinishRequest(Server *server, ServeRequest *r, const HLFixStats &stats, const double *times)
+{
+  HLFixError &e = r->error;
+  string result;
+
+  FormatResult(&result,e,stats,times);
+  r->post(result);
+
+  printf("  [%i] %s -> %s: %s%s, %i solids read, %i written, %i cached, read %.3lfs, load %.3lfs, process %.3lfs, write %.3lfs\n",
+    ++server->nrequests,r->flagInline ? "(inline)" : r->cl.rmffn,r->cl.outfn[0] != '\0' ? r->cl.outfn : "(inline)",
+    e.code == HLFIX_OK ? "done" : "ERROR: ",e.code == HLFIX_OK ? "" : e.msg,
+    stats.nsolidsRead,stats.nsolidsProcessed,stats.nsolidsCached,times[0],times[1],times[2],times[3]);
+  fflush(stdout);
+}
+
+// converts a request on the thread the pool was started by, streaming its messages, output and result
+static void ServeConvert(Server *server, ServeRequest *r)
+{
+  chrono::steady_clock::time_point start;
+  HLFixOptions options;
+  HLFixError error;
+  HLFixStats stats;
+  HLFixMap *map;
+  vector<string> wads;
+  double times[4];
+  FILE *f;
+  int i;
+
+  memset(&stats,0,sizeof(stats));
+  times[0] = r->readTime;
+  times[1] = times[2] = times[3] = 0;
+
+  options = r->cl.options;
+  options.threads = server->threads;
+  options.cache = server->cache;
+  options.message = SendMessage;
+  options.messageData = r;
+
+  start = chrono::steady_clock::now();
+  map = HLFixLoad(r->rmf.empty() ? NULL : &r->rmf[0],r->rmf.size(),&options,&r->error);
+  vector<char>().swap(r->rmf);
+  times[1] = Seconds(start);
+
+  if (map == NULL)
+  {
+    FinishRequest(server,r,stats,times);
+    return;
+  }
+
+  if (r->cl.flagWAD)
+  {
+    if (!ReadWadList(r->cl.wadfn,&wads))
+      SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"can't open ",r->cl.wadfn);
+
+    for (i = 0; i < int(wads.size()); i++)
+      HLFixAddWad(map,wads[i].c_str());
+  }
+
+  // as for the program, the output is written even if a pass failed
+
+  if (r->error.code == HLFIX_OK)
+  {
+    start = chrono::steady_clock::now();
+    HLFixProcess(map,&r->error);
+    times[2] = Seconds(start);
+
+    start = chrono::steady_clock::now();
+
+    if (r->cl.outfn[0] == '\0')
+    {
+      if (HLFixWrite(map,SendOutput,r,&error) != HLFIX_OK && r->error.code == HLFIX_OK)
+        r->error = error;
+    }
+    else if ((f = fopen(r->cl.outfn,options.writeRMF ? "wb" : "w")) == NULL)
+    {
+      if (r->error.code == HLFIX_OK)
+        SetServeError(&r->error,HLFIX_ERROR_WRITE,"can't open ",r->cl.outfn);
+    }
+    else
+    {
+      if (HLFixWrite(map,WriteFile,f,&error) != HLFIX_OK && r->error.code == HLFIX_OK)
+        r->error = error;
+
+      if (fclose(f) != 0 && r->error.code == HLFIX_OK)
+        SetServeError(&r->error,HLFIX_ERROR_WRITE,"can't write ",r->cl.outfn);
+    }
+
+    times[3] = Seconds(start);
+  }
+
+  HLFixGetStats(map,&stats);
+  HLFixFree(map);
+
+  FinishRequest(server,r,stats,times);
+}
+
+// reads the requests of a connection, queues each for conversion and sends its answer as it comes
+static void ServeClient(Server *server, int fd)
+{
+  ServeConnection conn(fd);
+  HLFixStats stats;
+  double times[4];
+  string line, reply;
+  int n;
+
+  memset(&stats,0,sizeof(stats));
+  times[0] = times[1] = times[2] = times[3] = 0;
+
+  while ((n = conn.readLine(&line)) != 0 && !conn.broken)
+  {
+    ServeRequest *r = new ServeRequest(&conn);
+
+    if (n < 0)
+      SetServeError(&r->error,HLFIX_ERROR_ARGUMENT,"request too long","");
+    else if (line.find_first_not_of(" \t") == string::npos)
+    {
+      delete r;
+      continue;
+    }
+    else if ((n = ReadRequest(line,r)) == 1)
+    {
+      {
+        lock_guard<mutex> guard(server->lock);
+
+        server->queue.push_back(r);
+        server->wake.notify_one();
+      }
+
+      unique_lock<mutex> guard(r->lock);
+
+      for (;;)
+      {
+        while (r->reply.empty() && !r->done)
+          r->ready.wait(guard);
+
+        if (r->reply.empty())
+          break;
+
+        reply.swap(r->reply);
+        guard.unlock();
+        conn.send(reply.data(),reply.size());
+        reply.clear();
+        guard.lock();
+        r->broken = conn.broken;
+      }
+
+      guard.unlock();
+      delete r;
+      continue;
+    }
+
+    times[0] = r->readTime;
+    reply.clear();
+    FormatResult(&reply,r->error,stats,times);
+    conn.send(reply.data(),reply.size());
+    delete r;
+
+    if (n < 0)
+      break;
+  }
+
+  close(fd);
+}
+
+static void ServeListener(Server *server, int fd)
+{
+  int client;
+
+  for (;;)
+  {
+    if ((client = accept(fd,NULL,NULL)) < 0)
+    {
+      if (errno != EINTR && errno != ECONNABORTED)
+      {
+        printf("Accepting a connection failed: %s\n",strerror(errno));
+        fflush(stdout);
+        this_thread::sleep_for(chrono::milliseconds(100));
+      }
+
+      continue;
+    }
+
+    thread(ServeClient,server,client).detach();
+  }
+}
+
+static void StopServer(int)
+{
+  unlink(ServeSocket);
+  _exit(0);
+}
+
+int RunServer(const char *socketfn, int threads, double megabytes)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  ServeRequest *r;
+  Server server;
+  mode_t mask;
+  int fd, ok;
+
+  if (strlen(socketfn) >= sizeof(addr.sun_path))
+  {
+    printf("Socket filename %s too long\n",socketfn);
+    return 1;
+  }
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,socketfn);
+
+  // a socket left by a server that was killed is replaced, but nothing else is
+
+  if (stat(socketfn,&st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(socketfn);
+
+  if (realpath(".",ServeRoot) == NULL)
+  {
+    printf("can't resolve the current directory: %s\n",strerror(errno));
+    return 1;
+  }
+
+  // requests read and write files as the server, so only its owner may connect
+
+  if ((fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0)
+    ok = 0;
+  else
+  {
+    mask = umask(0177);
+    ok = bind(fd,(struct sockaddr *)&addr,sizeof(addr)) == 0;
+    umask(mask);
+  }
+
+  if (!ok || chmod(socketfn,0600) != 0 || listen(fd,16) != 0)
+  {
+    printf("can't listen on %s: %s\n",socketfn,strerror(errno));
+    return 1;
+  }
+
+  strcpy(ServeSocket,socketfn);
+  signal(SIGINT,StopServer);
+  signal(SIGTERM,StopServer);
+  signal(SIGPIPE,SIG_IGN);
+
+  server.cache = HLFixCreateCache(megabytes);
+  server.threads = threads;
+  server.nrequests = 0;
+
+  printf("Serving on %s with %i threads and %lg megabytes for processed solids\n",socketfn,threads,megabytes);
+  fflush(stdout);
+
+  thread(ServeListener,&server,fd).detach();
+
+  // requests are converted on this thread, which the threads of the pool are started by and kept for
+
+  for (;;)
+  {
+    {
+      unique_lock<mutex> guard(server.lock);
+
+      while (server.queue.empty())
+        server.wake.wait(guard);
+
+      r = server.queue.front();
+      server.queue.pop_front();
+    }
+
+    ServeConvert(&server,r);
+
+    lock_guard<mutex> guard(r->lock);
+    r->done = 1;
+    r->ready.notify_all();
+  }
+}
@@ -0,0 +1,41 @@
+/*
+ * The contents of this file are copyright 2003 Jedediah Smith
+ * <jedediah@silencegreys.com>
+ * http://extension.ws/hlfix/
+ *
+ * This work is licensed under the Creative Commons "Attribution-Share Alike 3.0 Unported" License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-sa/3.0/legalcode
+ * or, send a letter to Creative Commons, 171 2nd Street, Suite 300, San Francisco, California, 94105, USA.
+*/
+
+
+#ifndef _INC_SERVER
+#define _INC_SERVER
+
+/*
+Listens on the Unix domain socket socketfn and converts the maps requested on it until the program is stopped.
+Requests are converted one at a time with their solids processed on threads threads, which are started once and
+kept, and the processed solids of each are kept in megabytes of memory so that later requests with the same solids
+and options skip processing them. Only solids processed independently of the rest of their map are kept: with
+projection or tesselation on, those with non-planar faces are processed afresh, as they share those faces with
+their neighbours, which may belong to another map. Inputs are read and results sent by a thread for each connection meanwhile.
+
+A connection may send any number of requests, each a line of arguments like those of the program, which may be
+quoted with "", and each is answered in order. Blank lines are skipped. The socket can only be connected to by the
+user the server runs as, and files must be given as relative paths that stay within the directory the server was
+started in, which they are relative to.
+  <mapname>[.rmf] [options]       converts a file
+  -i <bytes> [options]            converts the RMF image of that many bytes following the line
+Without -o the output is sent back instead of being written to a file. -j, -b and -gb can't be given. The answer
+is a series of lines, some followed by a block of data:
+  log <bytes>                     messages printed while converting, sent as they are printed
+  output <bytes>                  the output, when it is sent back
+  error <code> <entity> <brush> <offset> <message>
+                                  the first error, with the HLFIX_ERROR codes of hlfix.h
+  done <code> <solids read> <solids written> <solids cached> <read> <load> <process> <write>
+                                  always the last, with the times taken in seconds
+*/
+
+int RunServer(const char *socketfn, int threads, double megabytes);
+
+#endif